@@ -0,0 +1,521 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <iomanip>
+#include <cstdint>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS 1
+#endif
+
+/**
+ * Runs every calculate_average variant on the same input several times with
+ * a warm and/or cold page cache, and reports wall/user/sys time, throughput,
+ * peak RSS and hardware counters. Results go to stdout and, optionally, to CSV
+ * and JSON files so runs can be compared across commits.
+*/
+
+std::vector<std::string> targets = {"calc_baseline", "calc_v1", "calc_v2", "calc_v3", "calc"};
+std::string referenceTarget = "calc_baseline";
+std::string inputFileName = "./measurements.txt";
+std::string csvFileName;
+std::string jsonFileName;
+std::vector<std::string> targetArgs;
+int RUNS = 5;
+bool RUN_WARM = true;
+bool RUN_COLD = true;
+
+struct HardwareCounters {
+  bool valid = false;
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t cacheMisses = 0;
+  uint64_t branchMisses = 0;
+};
+
+struct RunResult {
+  bool ok = false;
+  double wallSeconds = 0;
+  double userSeconds = 0;
+  double sysSeconds = 0;
+  long peakRssKb = 0;
+  HardwareCounters counters;
+};
+
+struct Summary {
+  std::string target;
+  std::string cache;
+  int runs = 0;
+  bool outputMatches = true;
+  double medianWall = 0;
+  double p95Wall = 0;
+  double medianUser = 0;
+  double medianSys = 0;
+  double rowsPerSecond = 0;
+  double gbPerSecond = 0;
+  long peakRssKb = 0;
+  HardwareCounters counters;
+};
+
+struct InputInfo {
+  size_t bytes = 0;
+  size_t rows = 0;
+};
+
+bool countInput(const std::string& fileName, InputInfo& info) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb)) {
+    close(fd);
+    return false;
+  }
+  info.bytes = sb.st_size;
+  info.rows = 0;
+
+  if (info.bytes > 0) {
+    char* data = (char*) mmap(nullptr, info.bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    const char* ptr = data;
+    const char* end = data + info.bytes;
+    while ((ptr = (const char*) memchr(ptr, '\n', end - ptr)) != nullptr) {
+      ++info.rows;
+      ++ptr;
+    }
+    if (data[info.bytes - 1] != '\n') {
+      ++info.rows;
+    }
+    munmap(data, info.bytes);
+  }
+
+  close(fd);
+  return true;
+}
+
+/**
+ * Drops the input file from the page cache. posix_fadvise works without
+ * privileges for clean pages; drop_caches is attempted too when we are root.
+*/
+void evictPageCache(const std::string& fileName) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd != -1) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+
+  sync();
+  std::ofstream dropCaches("/proc/sys/vm/drop_caches");
+  if (dropCaches) {
+    dropCaches << "1" << std::endl;
+  }
+}
+
+#ifdef HAVE_PERF_EVENTS
+/**
+ * Hardware counters of a child process and every thread it starts. Counting
+ * starts when the child calls exec, so the fork/exec setup is not measured.
+*/
+class PerfCounters {
+public:
+  explicit PerfCounters(pid_t pid) {
+    const uint64_t configs[] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES,
+      PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (uint64_t config: configs) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.enable_on_exec = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds.push_back(syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0));
+    }
+  }
+
+  ~PerfCounters() {
+    for (int fd: fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  HardwareCounters read() {
+    HardwareCounters counters;
+    uint64_t values[4];
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i] < 0 || ::read(fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+        return counters;
+      }
+    }
+    counters.valid = true;
+    counters.cycles = values[0];
+    counters.instructions = values[1];
+    counters.cacheMisses = values[2];
+    counters.branchMisses = values[3];
+    return counters;
+  }
+
+private:
+  std::vector<int> fds;
+};
+#endif
+
+/**
+ * Runs ./target on the input once, sending its stdout to outputFileName.
+*/
+RunResult runOnce(const std::string& target, const std::string& outputFileName) {
+  RunResult result;
+
+  int startPipe[2];
+  if (pipe(startPipe) != 0) {
+    return result;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Wait until the parent has attached the counters.
+    close(startPipe[1]);
+    char go;
+    if (read(startPipe[0], &go, 1) != 1) {
+      _exit(127);
+    }
+    close(startPipe[0]);
+
+    int out = open(outputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(out, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+
+    std::string path = "./" + target;
+    std::vector<char*> argv;
+    argv.push_back((char*) path.c_str());
+    for (auto& arg: targetArgs) {
+      argv.push_back((char*) arg.c_str());
+    }
+    argv.push_back((char*) inputFileName.c_str());
+    argv.push_back(nullptr);
+    execv(path.c_str(), argv.data());
+    _exit(127);
+  }
+  close(startPipe[0]);
+  if (pid < 0) {
+    close(startPipe[1]);
+    return result;
+  }
+
+#ifdef HAVE_PERF_EVENTS
+  PerfCounters perf(pid);
+#endif
+  auto start = std::chrono::steady_clock::now();
+  if (write(startPipe[1], "g", 1) != 1) {
+    kill(pid, SIGKILL);
+  }
+  close(startPipe[1]);
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    return result;
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  result.wallSeconds = std::chrono::duration<double>(end - start).count();
+  result.userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  result.sysSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  result.peakRssKb = usage.ru_maxrss;
+#ifdef HAVE_PERF_EVENTS
+  result.counters = perf.read();
+#endif
+  return result;
+}
+
+/**
+ * Nearest-rank percentile, p in [0, 100].
+*/
+double percentile(std::vector<double> values, double p) {
+  std::sort(values.begin(), values.end());
+  size_t rank = (size_t) std::ceil(p / 100 * values.size());
+  return values[std::max<size_t>(rank, 1) - 1];
+}
+
+uint64_t medianCounter(std::vector<uint64_t> values) {
+  std::sort(values.begin(), values.end());
+  return values[(values.size() - 1) / 2];
+}
+
+bool sameFileContents(const std::string& a, const std::string& b) {
+  std::ifstream fa(a, std::ios::binary);
+  std::ifstream fb(b, std::ios::binary);
+  std::stringstream sa, sb;
+  sa << fa.rdbuf();
+  sb << fb.rdbuf();
+  return fa && fb && sa.str() == sb.str();
+}
+
+std::string outputFileFor(const std::string& target) {
+  return "/tmp/bench_" + target + "_" + std::to_string(getpid()) + ".out";
+}
+
+bool benchmark(const std::string& target, bool cold, const InputInfo& input, Summary& summary) {
+  std::string outputFileName = outputFileFor(target);
+  summary.target = target;
+  summary.cache = cold ? "cold" : "warm";
+  summary.runs = RUNS;
+
+  if (!cold) {
+    // Untimed run to warm the page cache.
+    runOnce(target, outputFileName);
+  }
+
+  std::vector<RunResult> results;
+  for (int i = 0; i < RUNS; ++i) {
+    if (cold) {
+      evictPageCache(inputFileName);
+    }
+    RunResult result = runOnce(target, outputFileName);
+    if (!result.ok) {
+      std::cerr << target << " failed" << std::endl;
+      return false;
+    }
+    results.push_back(result);
+  }
+
+  std::vector<double> wall, user, sys;
+  std::vector<uint64_t> cycles, instructions, cacheMisses, branchMisses;
+  summary.counters.valid = true;
+  for (auto& result: results) {
+    wall.push_back(result.wallSeconds);
+    user.push_back(result.userSeconds);
+    sys.push_back(result.sysSeconds);
+    summary.peakRssKb = std::max(summary.peakRssKb, result.peakRssKb);
+    summary.counters.valid = summary.counters.valid && result.counters.valid;
+    cycles.push_back(result.counters.cycles);
+    instructions.push_back(result.counters.instructions);
+    cacheMisses.push_back(result.counters.cacheMisses);
+    branchMisses.push_back(result.counters.branchMisses);
+  }
+
+  summary.medianWall = percentile(wall, 50);
+  summary.p95Wall = percentile(wall, 95);
+  summary.medianUser = percentile(user, 50);
+  summary.medianSys = percentile(sys, 50);
+  summary.rowsPerSecond = input.rows / summary.medianWall;
+  summary.gbPerSecond = input.bytes / 1e9 / summary.medianWall;
+  if (summary.counters.valid) {
+    summary.counters.cycles = medianCounter(cycles);
+    summary.counters.instructions = medianCounter(instructions);
+    summary.counters.cacheMisses = medianCounter(cacheMisses);
+    summary.counters.branchMisses = medianCounter(branchMisses);
+  }
+  return true;
+}
+
+void writeCsv(const std::vector<Summary>& summaries, const InputInfo& input) {
+  std::ofstream out(csvFileName);
+  out << "target,cache,runs,input_bytes,rows,median_wall_s,p95_wall_s,median_user_s,"
+    << "median_sys_s,rows_per_s,gb_per_s,peak_rss_kb,cycles,instructions,cache_misses,"
+    << "branch_misses,output_matches\n";
+  for (auto& s: summaries) {
+    out << s.target << "," << s.cache << "," << s.runs << "," << input.bytes << ","
+      << input.rows << "," << s.medianWall << "," << s.p95Wall << "," << s.medianUser << ","
+      << s.medianSys << "," << s.rowsPerSecond << "," << s.gbPerSecond << "," << s.peakRssKb;
+    if (s.counters.valid) {
+      out << "," << s.counters.cycles << "," << s.counters.instructions << ","
+        << s.counters.cacheMisses << "," << s.counters.branchMisses;
+    } else {
+      out << ",,,,";
+    }
+    out << "," << (s.outputMatches ? "true" : "false") << "\n";
+  }
+}
+
+void writeJson(const std::vector<Summary>& summaries, const InputInfo& input) {
+  std::ofstream out(jsonFileName);
+  out << "{\n  \"input\": {\"file\": \"" << inputFileName << "\", \"bytes\": " << input.bytes
+    << ", \"rows\": " << input.rows << "},\n  \"results\": [\n";
+  for (size_t i = 0; i < summaries.size(); ++i) {
+    const Summary& s = summaries[i];
+    out << "    {\"target\": \"" << s.target << "\", \"cache\": \"" << s.cache
+      << "\", \"runs\": " << s.runs
+      << ", \"median_wall_s\": " << s.medianWall << ", \"p95_wall_s\": " << s.p95Wall
+      << ", \"median_user_s\": " << s.medianUser << ", \"median_sys_s\": " << s.medianSys
+      << ", \"rows_per_s\": " << s.rowsPerSecond << ", \"gb_per_s\": " << s.gbPerSecond
+      << ", \"peak_rss_kb\": " << s.peakRssKb;
+    if (s.counters.valid) {
+      out << ", \"cycles\": " << s.counters.cycles
+        << ", \"instructions\": " << s.counters.instructions
+        << ", \"cache_misses\": " << s.counters.cacheMisses
+        << ", \"branch_misses\": " << s.counters.branchMisses;
+    }
+    out << ", \"output_matches\": " << (s.outputMatches ? "true" : "false") << "}"
+      << (i + 1 < summaries.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+void printSummary(const Summary& s) {
+  std::cout << std::left << std::setw(14) << s.target << std::setw(6) << s.cache
+    << std::right << std::fixed << std::setprecision(3)
+    << " wall " << s.medianWall << "s (p95 " << s.p95Wall << "s)"
+    << " user " << s.medianUser << "s sys " << s.medianSys << "s"
+    << std::setprecision(1)
+    << " " << s.rowsPerSecond / 1e6 << " Mrows/s"
+    << std::setprecision(2) << " " << s.gbPerSecond << " GB/s"
+    << " rss " << s.peakRssKb / 1024 << " MB";
+  if (s.counters.valid) {
+    std::cout << std::setprecision(2) << " IPC "
+      << (double) s.counters.instructions / std::max<uint64_t>(s.counters.cycles, 1);
+  }
+  if (!s.outputMatches) {
+    std::cout << "  OUTPUT DIFFERS FROM " << referenceTarget;
+  }
+  std::cout << std::endl;
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program
+    << " [--runs N] [--targets a,b,...] [--reference target] [--cache warm|cold|both]"
+    << " [--csv file] [--json file] [--args \"target flags\"] [input_file]" << std::endl;
+}
+
+bool parseArgs(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--runs" && i + 1 < argc) {
+      RUNS = std::atoi(argv[++i]);
+      if (RUNS < 1) {
+        std::cerr << "Invalid run count: " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg == "--targets" && i + 1 < argc) {
+      targets = splitList(argv[++i]);
+    } else if (arg == "--reference" && i + 1 < argc) {
+      referenceTarget = argv[++i];
+    } else if (arg == "--cache" && i + 1 < argc) {
+      std::string cache = argv[++i];
+      RUN_WARM = cache == "warm" || cache == "both";
+      RUN_COLD = cache == "cold" || cache == "both";
+      if (!RUN_WARM && !RUN_COLD) {
+        std::cerr << "Unknown cache mode: " << cache << std::endl;
+        return false;
+      }
+    } else if (arg == "--csv" && i + 1 < argc) {
+      csvFileName = argv[++i];
+    } else if (arg == "--json" && i + 1 < argc) {
+      jsonFileName = argv[++i];
+    } else if (arg == "--args" && i + 1 < argc) {
+      std::stringstream stream(argv[++i]);
+      std::string targetArg;
+      while (stream >> targetArg) {
+        targetArgs.push_back(targetArg);
+      }
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    } else {
+      inputFileName = arg;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!parseArgs(argc, argv)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  InputInfo input;
+  if (!countInput(inputFileName, input)) {
+    std::cerr << "Error reading input file: " << inputFileName << std::endl;
+    return 1;
+  }
+  std::cout << inputFileName << ": " << input.bytes << " bytes, " << input.rows << " rows, "
+    << RUNS << " runs per target" << std::endl;
+
+  for (auto& target: targets) {
+    if (access(target.c_str(), X_OK) != 0) {
+      std::cerr << "Executable " << target << " not found. Please compile it first." << std::endl;
+      return 1;
+    }
+  }
+
+  // The reference output every other target is compared against.
+  std::string referenceOutput = outputFileFor(referenceTarget) + ".reference";
+  if (!runOnce(referenceTarget, referenceOutput).ok) {
+    std::cerr << referenceTarget << " failed" << std::endl;
+    return 1;
+  }
+
+  std::vector<Summary> summaries;
+  bool allMatch = true;
+  for (auto& target: targets) {
+    for (bool cold: {false, true}) {
+      if ((cold && !RUN_COLD) || (!cold && !RUN_WARM)) {
+        continue;
+      }
+      Summary summary;
+      if (!benchmark(target, cold, input, summary)) {
+        return 1;
+      }
+      summary.outputMatches = sameFileContents(outputFileFor(target), referenceOutput);
+      allMatch = allMatch && summary.outputMatches;
+      printSummary(summary);
+      summaries.push_back(summary);
+    }
+    unlink(outputFileFor(target).c_str());
+  }
+  unlink(referenceOutput.c_str());
+
+  if (!csvFileName.empty()) {
+    writeCsv(summaries, input);
+  }
+  if (!jsonFileName.empty()) {
+    writeJson(summaries, input);
+  }
+
+  return allMatch ? 0 : 2;
+}
@@ -0,0 +1,126 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Client for calc --serve. Sends one command ("get" for the cached result,
+ * "stop" to shut the server down) and prints the reply. With --repeat N it
+ * sends the command N times and reports the mean and best round trip to
+ * stderr, printing only the last reply.
+*/
+
+std::string socketPath;
+std::string command = "get";
+int REPEAT = 1;
+
+/**
+ * Sends command to the server and stores its reply. Returns false if the
+ * server could not be reached.
+*/
+bool query(std::string& reply) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socketPath << std::endl;
+    return false;
+  }
+  memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (const sockaddr*) &address, sizeof(address)) != 0) {
+    std::cerr << "Error connecting to " << socketPath << ": " << strerror(errno) << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  std::string request = command + "\n";
+  if (write(fd, request.data(), request.size()) != (ssize_t) request.size()) {
+    std::cerr << "Error sending command" << std::endl;
+    close(fd);
+    return false;
+  }
+  shutdown(fd, SHUT_WR);
+
+  reply.clear();
+  char buffer[64 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      std::cerr << "Error reading reply" << std::endl;
+      close(fd);
+      return false;
+    }
+    reply.append(buffer, n);
+  }
+  close(fd);
+  return true;
+}
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [--repeat N] SOCKET [get|stop]" << std::endl;
+}
+
+bool parseArgs(int argc, char** argv) {
+  int positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--repeat" && i + 1 < argc) {
+      REPEAT = std::atoi(argv[++i]);
+      if (REPEAT < 1) {
+        std::cerr << "Invalid repeat count: " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    } else if (positional == 0) {
+      socketPath = arg;
+      ++positional;
+    } else if (positional == 1) {
+      command = arg;
+      ++positional;
+    } else {
+      return false;
+    }
+  }
+  return !socketPath.empty();
+}
+
+int main(int argc, char** argv) {
+  if (!parseArgs(argc, argv)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  std::string reply;
+  double totalSeconds = 0;
+  double bestSeconds = 0;
+  for (int i = 0; i < REPEAT; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    if (!query(reply)) {
+      return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    totalSeconds += seconds;
+    bestSeconds = i == 0 ? seconds : std::min(bestSeconds, seconds);
+  }
+
+  std::cout << reply << std::flush;
+  if (REPEAT > 1) {
+    std::cerr << REPEAT << " queries, mean " << totalSeconds / REPEAT * 1e6
+      << " us, best " << bestSeconds * 1e6 << " us" << std::endl;
+  }
+  return 0;
+}
@@ -1,274 +1,4110 @@
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <unordered_map>
 #include <algorithm>
 #include <vector>
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
 #include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <fcntl.h>
+#include <dirent.h>
+#include <glob.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
 #include <unistd.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+#include <climits>
+#include <cmath>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 
 bool DEBUGGING = true;
 
-size_t CHUNK_SIZE = 1024 * 1024 * 50; // 50 MB chunks
+size_t CHUNK_SIZE = 1024 * 1024 * 4; // 4 MB chunks claimed by workers
 
 std::string inputFileName = "./src/test/resources/samples/measurements-10.txt";
 // std::string inputFileName = "./measurements.txt";
 
-int THREADS_COUNT = 6;
-int LEFT_OVER_BUFFER_SIZE = 1000;
-int HANDLE_LEFT_OVER_BUFFER_THREASHOLD = 700;
+/**
+ * Inputs as given on the command line: files, directories or glob patterns.
+ * They expand to one or more files that are aggregated into one result.
+*/
+std::vector<std::string> inputArgs;
+
+int THREADS_COUNT = std::max(1u, std::thread::hardware_concurrency());
 
 std::mutex StationsMutex;
 
 /**
- * Temperatures are multiplied by 10 as stored as int
+ * Pin workers to cores and keep file regions and tables on the NUMA node
+ * that processes them (--numa).
+*/
+bool NUMA_AWARE = false;
+
+/**
+ * Validate every row against the input format instead of trusting the input.
+*/
+bool STRICT_PARSING = false;
+
+/**
+ * Input format: the character between name and value, and the number of
+ * fractional digits of values, which are also used for the output. Each
+ * supported combination has its own compiled parse kernel, see RowFormat.
+*/
+char INPUT_DELIMITER = ';';
+int INPUT_DECIMALS = 1;
+
+/**
+ * Also print p50/p95/p99 per station (--percentiles). Every table then keeps
+ * a histogram with one counter per possible temperature next to each station.
+*/
+bool PERCENTILES = false;
+
+/**
+ * Rows carry a third column with an epoch timestamp in seconds, and stations
+ * are aggregated per window of this many seconds (--time-bucket). 0 means
+ * two-column rows.
+*/
+int64_t TIME_BUCKET_SECONDS = 0;
+
+/**
+ * How the input file is mapped. The whole file is always mapped at once;
+ * these only control prefaulting and kernel hints.
+*/
+bool MAP_POPULATE_PAGES = false;
+bool MADVISE_SEQUENTIAL = false;
+bool MADVISE_HUGEPAGE = false;
+
+/**
+ * Input backend: "mmap" maps the file, "pread" and "uring" stream it through
+ * a ring of aligned buffers, optionally bypassing the page cache with O_DIRECT.
+*/
+std::string READER = "mmap";
+bool DIRECT_IO = false;
+size_t STREAM_BUFFER_SIZE = 1024 * 1024 * 8; // 8 MB per read
+
+/**
+ * Convert the text input to the binary columnar format at this path instead
+ * of aggregating it. Encoded files are detected by their magic when read.
+*/
+std::string CONVERT_OUTPUT;
+
+/**
+ * Keep the aggregate of an append-only input in this file and on the next
+ * run only parse what was appended since (--checkpoint).
+*/
+std::string CHECKPOINT_PATH;
+
+/**
+ * Run as a daemon on this Unix socket instead of printing once (--serve):
+ * aggregate the input, fold in rows appended to it and answer queries from
+ * the cached result. calc_client talks to it.
+*/
+std::string SERVE_SOCKET;
+
+/**
+ * Keep per-chunk aggregates of the input in this sidecar file (--index), and
+ * only aggregate the rows that start within [RANGE_START, RANGE_END)
+ * (--range START:END, byte offsets).
+*/
+std::string INDEX_PATH;
+size_t RANGE_START = 0;
+size_t RANGE_END = SIZE_MAX;
+
+/**
+ * Print per-phase and per-worker statistics to stderr. The counters only
+ * exist in builds with ONEBRC_STATS defined (make calc_stats); everything
+ * wrapped in STATS() compiles to nothing otherwise.
+*/
+bool PRINT_STATS = false;
+
+#ifdef ONEBRC_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+
+#ifdef ONEBRC_STATS
+inline uint64_t readTicks() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct WorkerStats {
+  uint64_t chunks = 0;
+  uint64_t rows = 0;
+  uint64_t bytes = 0;
+  uint64_t scanTicks = 0;
+  uint64_t hashTicks = 0;
+  uint64_t mergeTicks = 0;
+  uint64_t idleTicks = 0;
+  uint64_t lookups = 0;
+  uint64_t probes = 0;
+  uint64_t collisions = 0;
+  uint64_t maxProbeLength = 0;
+  uint64_t jobEndTicks = 0;
+};
+
+struct RunStats {
+  uint64_t startTicks = readTicks();
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  uint64_t mapTicks = 0;
+  uint64_t parseTicks = 0;
+  uint64_t mergeTicks = 0;
+  uint64_t outputTicks = 0;
+};
+
+RunStats RUN_STATS;
+std::vector<WorkerStats> WORKER_STATS;
+
+// Threads outside the pool count into a scratch slot, so the hot path never
+// checks for null.
+WorkerStats UNTRACKED_STATS;
+thread_local WorkerStats* workerStats = &UNTRACKED_STATS;
+#endif
+
+/**
+ * Temperatures are multiplied by 10 as stored as int.
+ * The sum is 64-bit so a billion rows on one station cannot overflow it, while
+ * min/max fit in 16 bits (-999..999) and the count in 32 bits (up to ~4 billion
+ * rows per station), keeping the struct at 16 bytes.
+*/
+class Station {
+public:
+  int64_t totalTemp = 0;
+  uint32_t measurementCount = 0;
+  int16_t minTemp = INT16_MAX;
+  int16_t maxTemp = INT16_MIN;
+public:
+  void addMeasurement(int temp) {
+    totalTemp += temp;
+    ++measurementCount;
+
+    minTemp = temp < minTemp ? temp : minTemp;
+    maxTemp = temp > maxTemp ? temp : maxTemp;
+  }
+
+  void merge(const Station& other) {
+    totalTemp += other.totalTemp;
+    measurementCount += other.measurementCount;
+
+    minTemp = std::min(minTemp, other.minTemp);
+    maxTemp = std::max(maxTemp, other.maxTemp);
+  }
+
+  /**
+   * Mean in tenths, rounded half up like Java's Math.round in the reference
+   * implementation: floor((2 * sum + count) / (2 * count)), computed exactly
+   * in integers.
+  */
+  int averageTemp10() const {
+    int64_t numerator = 2 * totalTemp + measurementCount;
+    int64_t denominator = 2 * (int64_t) measurementCount;
+    int64_t quotient = numerator / denominator;
+    return quotient - (numerator % denominator < 0);
+  }
+};
+
+static_assert(sizeof(Station) == 16, "Station should stay 16 bytes");
+
+/**
+ * Histogram buckets for --percentiles: one per tenth in -99.9..99.9. Values
+ * outside that range, only possible without --strict, go to the end buckets.
+*/
+constexpr int HISTOGRAM_MIN = -999;
+constexpr size_t HISTOGRAM_BUCKETS = 1999;
+
+inline size_t histogramBucket(int temp) {
+  return std::clamp(temp, HISTOGRAM_MIN, HISTOGRAM_MIN + (int) HISTOGRAM_BUCKETS - 1) - HISTOGRAM_MIN;
+}
+
+/**
+ * Hash of a station name, computed once per row. Names are consumed 8 bytes at
+ * a time and the tail is copied into a zeroed word so we never read past the
+ * name.
+*/
+inline uint32_t hashName(const char* name, size_t length) {
+  const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+  uint64_t hash = length * multiplier;
+
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, name + i, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  if (i < length) {
+    uint64_t word = 0;
+    memcpy(&word, name + i, length - i);
+    hash = (hash ^ word) * multiplier;
+  }
+
+  hash ^= hash >> 32;
+  return (uint32_t) hash;
+}
+
+/**
+ * Bump allocator owning a table's name bytes and slot arrays. Memory comes
+ * in large blocks and is only released, all at once, when the arena is
+ * destroyed, so inserting a key or growing a table never frees and rarely
+ * mallocs. Each table has its own arena, so workers never share an allocator.
+*/
+class Arena {
+public:
+  Arena() = default;
+  Arena(Arena&& other) noexcept
+    : blocks(std::move(other.blocks)),
+      cursor(std::exchange(other.cursor, nullptr)),
+      remaining(std::exchange(other.remaining, 0)) {}
+
+  Arena& operator=(Arena&& other) noexcept {
+    blocks = std::move(other.blocks);
+    cursor = std::exchange(other.cursor, nullptr);
+    remaining = std::exchange(other.remaining, 0);
+    return *this;
+  }
+
+  void* allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - (uintptr_t) cursor % alignment) % alignment;
+    if (cursor == nullptr || size + padding > remaining) {
+      size_t blockSize = std::max(size + alignment, ARENA_BLOCK_SIZE);
+      blocks.emplace_back(new char[blockSize]);
+      cursor = blocks.back().get();
+      remaining = blockSize;
+      padding = (alignment - (uintptr_t) cursor % alignment) % alignment;
+    }
+
+    char* result = cursor + padding;
+    cursor += padding + size;
+    remaining -= padding + size;
+    return result;
+  }
+
+  /**
+   * Default-constructs count objects of T in the arena. T must be trivially
+   * destructible, since the arena never runs destructors.
+  */
+  template <typename T>
+  T* allocateArray(size_t count) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    T* result = (T*) allocate(count * sizeof(T), alignof(T));
+    std::uninitialized_value_construct_n(result, count);
+    return result;
+  }
+
+  const char* copy(const char* data, size_t length) {
+    char* result = (char*) allocate(length, 1);
+    memcpy(result, data, length);
+    return result;
+  }
+
+private:
+  static constexpr size_t ARENA_BLOCK_SIZE = 256 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char* cursor = nullptr;
+  size_t remaining = 0;
+};
+
+/**
+ * Flat open-addressing table from station name to Station, using linear
+ * probing. Lookups take a non-owning (pointer, length) view of the name, e.g.
+ * straight into the mapped file, so the hot path neither allocates nor hashes
+ * twice. Sized so the 10,000 unique keys allowed by the challenge stay below
+ * one third load; it still grows if a file has more.
+*/
+class Stations {
+public:
+  struct Entry {
+    const char* name = nullptr;
+    uint32_t nameLength = 0;
+    uint32_t hash = 0;
+    Station station;
+
+    std::string_view key() const {
+      return std::string_view(name, nameLength);
+    }
+  };
+
+  class iterator {
+  public:
+    iterator(Entry* slots, const uint32_t* index): slots(slots), index(index) {}
+
+    Entry& operator*() const { return slots[*index]; }
+    Entry* operator->() const { return &slots[*index]; }
+    iterator& operator++() { ++index; return *this; }
+    bool operator!=(const iterator& other) const { return index != other.index; }
+
+  private:
+    Entry* slots;
+    const uint32_t* index;
+  };
+
+  /**
+   * capacity must be a power of two.
+  */
+  explicit Stations(size_t capacity = INITIAL_CAPACITY)
+    : withHistograms(PERCENTILES) {
+    allocateSlots(capacity);
+  }
+
+  Stations(Stations&& other) noexcept
+    : arena(std::move(other.arena)),
+      slots(std::exchange(other.slots, nullptr)),
+      occupied(std::exchange(other.occupied, nullptr)),
+      histograms(std::exchange(other.histograms, nullptr)),
+      count(std::exchange(other.count, 0)),
+      mask(std::exchange(other.mask, 0)),
+      withHistograms(other.withHistograms) {}
+
+  Stations& operator=(Stations&& other) noexcept {
+    arena = std::move(other.arena);
+    slots = std::exchange(other.slots, nullptr);
+    occupied = std::exchange(other.occupied, nullptr);
+    histograms = std::exchange(other.histograms, nullptr);
+    count = std::exchange(other.count, 0);
+    mask = std::exchange(other.mask, 0);
+    withHistograms = other.withHistograms;
+    return *this;
+  }
+
+  Station& findOrInsert(const char* name, size_t length) {
+    return findOrInsertEntry(name, length, hashName(name, length), true).station;
+  }
+
+  Station& findOrInsert(const char* name, size_t length, uint32_t hash) {
+    return findOrInsertEntry(name, length, hash, true).station;
+  }
+
+  /**
+   * Records one measurement, including its histogram bucket. Only for tables
+   * created with PERCENTILES set.
+  */
+  void addWithHistogram(const char* name, size_t length, uint32_t hash, int temp) {
+    Entry& entry = findOrInsertEntry(name, length, hash, true);
+    entry.station.addMeasurement(temp);
+    ++histograms[&entry - slots][histogramBucket(temp)];
+  }
+
+  /**
+   * Merges an entry of another table, with its histogram, into this one. A
+   * new key points at the other table's name bytes instead of copying them,
+   * so they must outlive this table.
+  */
+  void mergeBorrowed(const Stations& from, const Entry& entry) {
+    Entry& target = findOrInsertEntry(entry.name, entry.nameLength, entry.hash, false);
+    target.station.merge(entry.station);
+    if (withHistograms) {
+      uint32_t* counts = histograms[&target - slots];
+      const uint32_t* otherCounts = from.histogramOf(entry);
+      for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        counts[i] += otherCounts[i];
+      }
+    }
+  }
+
+  /**
+   * The HISTOGRAM_BUCKETS counters of an entry of this table, or nullptr
+   * without PERCENTILES.
+  */
+  const uint32_t* histogramOf(const Entry& entry) const {
+    return withHistograms ? histograms[&entry - slots] : nullptr;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  iterator begin() { return iterator(slots, occupied); }
+  iterator end() { return iterator(slots, occupied + count); }
+
+private:
+  static constexpr size_t INITIAL_CAPACITY = 1 << 15;
+
+  Entry& findOrInsertEntry(const char* name, size_t length, uint32_t hash, bool copyName) {
+    size_t idx = hash & mask;
+    STATS(uint64_t probeLength = 1;)
+    STATS(++workerStats->lookups;)
+    while (true) {
+      Entry& entry = slots[idx];
+      if (entry.name == nullptr) {
+        STATS(recordProbe(probeLength);)
+        return insert(idx, name, length, hash, copyName);
+      }
+      if (entry.hash == hash
+          && entry.nameLength == length
+          && memcmp(entry.name, name, length) == 0) {
+        STATS(recordProbe(probeLength);)
+        return entry;
+      }
+      STATS(++probeLength; ++workerStats->collisions;)
+      idx = (idx + 1) & mask;
+    }
+  }
+
+#ifdef ONEBRC_STATS
+  static void recordProbe(uint64_t probeLength) {
+    workerStats->probes += probeLength;
+    workerStats->maxProbeLength = std::max(workerStats->maxProbeLength, probeLength);
+  }
+#endif
+
+  Entry& insert(size_t idx, const char* name, size_t length, uint32_t hash, bool copyName) {
+    if ((count + 1) * 2 > mask + 1) {
+      grow();
+      return findOrInsertEntry(name, length, hash, copyName);
+    }
+
+    Entry& entry = slots[idx];
+    entry.name = copyName ? arena.copy(name, length) : name;
+    entry.nameLength = length;
+    entry.hash = hash;
+    occupied[count++] = idx;
+    if (withHistograms) {
+      histograms[idx] = arena.allocateArray<uint32_t>(HISTOGRAM_BUCKETS);
+    }
+    return entry;
+  }
+
+  /**
+   * The table holds at most capacity / 2 keys before it grows, which bounds
+   * the occupied list.
+  */
+  void allocateSlots(size_t capacity) {
+    slots = arena.allocateArray<Entry>(capacity);
+    occupied = arena.allocateArray<uint32_t>(capacity / 2);
+    if (withHistograms) {
+      histograms = arena.allocateArray<uint32_t*>(capacity);
+    }
+    mask = capacity - 1;
+  }
+
+  /**
+   * Doubles the table. The old arrays stay in the arena until the table is
+   * destroyed; with doubling they add up to less than the live ones.
+  */
+  void grow() {
+    Entry* oldSlots = slots;
+    uint32_t* oldOccupied = occupied;
+    uint32_t** oldHistograms = histograms;
+    allocateSlots(2 * (mask + 1));
+
+    for (size_t i = 0; i < count; ++i) {
+      Entry& entry = oldSlots[oldOccupied[i]];
+      size_t newIdx = entry.hash & mask;
+      while (slots[newIdx].name != nullptr) {
+        newIdx = (newIdx + 1) & mask;
+      }
+      slots[newIdx] = entry;
+      occupied[i] = newIdx;
+      if (withHistograms) {
+        histograms[newIdx] = oldHistograms[oldOccupied[i]];
+      }
+    }
+  }
+
+  Arena arena;
+  Entry* slots = nullptr;
+  uint32_t* occupied = nullptr;
+  // Parallel to slots, only allocated with histograms.
+  uint32_t** histograms = nullptr;
+  size_t count = 0;
+  size_t mask = 0;
+  bool withHistograms;
+};
+
+/**
+ * The merged result, split by hash into shards that were merged in parallel.
+ * Every station lives in exactly one shard.
+*/
+using MergedStations = std::vector<Stations>;
+
+inline size_t shardOf(uint32_t hash, size_t shardCount) {
+  // Use the high bits; tables index slots by the low bits.
+  return ((uint64_t) hash * shardCount) >> 32;
+}
+
+/**
+ * Appends a value scaled by 10^decimals as a decimal with that many
+ * fractional digits, e.g. -123 with one decimal as "-12.3", and returns the
+ * new end of out. With zero decimals the value is printed as an integer.
+*/
+inline char* formatFixed(char* out, int64_t value, int decimals) {
+  if (value < 0) {
+    *out++ = '-';
+    value = -value;
+  }
+
+  char digits[20];
+  int count = 0;
+  for (int i = 0; i < decimals; ++i) {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  }
+  if (decimals > 0) {
+    digits[count++] = '.';
+  }
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (count > 0) {
+    *out++ = digits[--count];
+  }
+  return out;
+}
+
+/**
+ * Writes all of data to fd, retrying short writes.
+*/
+bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Writes all of data to fd at offset, retrying short writes.
+*/
+bool pwriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+/**
+ * Nearest-rank percentiles from a histogram of count values: the smallest
+ * value with at least ceil(p * count / 100) values at or below it.
+*/
+void histogramPercentiles(const uint32_t* histogram, uint64_t count, int results[3]) {
+  const int percentiles[3] = {50, 95, 99};
+  uint64_t seen = 0;
+  int next = 0;
+  for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS && next < 3; ++bucket) {
+    seen += histogram[bucket];
+    while (next < 3 && seen * 100 >= percentiles[next] * count) {
+      results[next++] = (int) bucket + HISTOGRAM_MIN;
+    }
+  }
+}
+
+/**
+ * Formats {name=min/mean/max, ...} sorted by name, with /p50/p95/p99 appended
+ * under --percentiles. Entries are sorted by pointer with a byte-wise
+ * comparator and formatted straight from the integer tenths into one buffer.
+ *
+ * Under --time-bucket the keys start with their bucket (see timeBucketKey),
+ * so the same sort orders by bucket and then name, and each bucket is printed
+ * on its own line as "<bucket start> {name=min/mean/max, ...}".
+*/
+std::string formatOutput(MergedStations& shards) {
+  struct Row {
+    const Stations::Entry* entry;
+    const uint32_t* histogram;
+  };
+  std::vector<Row> entries;
+  size_t bufferSize = 3;
+  for (Stations& shard: shards) {
+    for (const auto& entry: shard) {
+      entries.push_back({&entry, shard.histogramOf(entry)});
+      // name, '=', six values of at most 21 chars, five '/', ", "
+      bufferSize += entry.nameLength + 1 + 6 * 21 + 5 + 2;
+    }
+  }
+
+  std::sort(entries.begin(), entries.end(), [](const Row& rowA, const Row& rowB) {
+    const Stations::Entry* a = rowA.entry;
+    const Stations::Entry* b = rowB.entry;
+    int cmp = memcmp(a->name, b->name, std::min(a->nameLength, b->nameLength));
+    return cmp != 0 ? cmp < 0 : a->nameLength < b->nameLength;
+  });
+
+  bool bucketed = TIME_BUCKET_SECONDS > 0;
+  if (bucketed) {
+    // a bucket start of at most 20 chars, ' ', "{}\n" per entry at worst
+    bufferSize += entries.size() * 24;
+  }
+
+  std::string buffer(bufferSize, '\0');
+  char* out = buffer.data();
+  if (!bucketed) {
+    *out++ = '{';
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const Stations::Entry& entry = *entries[i].entry;
+    const char* name = entry.name;
+    size_t nameLength = entry.nameLength;
+    if (bucketed) {
+      const char* previous = i == 0 ? nullptr : entries[i - 1].entry->name;
+      if (previous == nullptr || memcmp(previous, name, 8) != 0) {
+        if (previous != nullptr) {
+          *out++ = '}';
+          *out++ = '\n';
+        }
+        uint64_t bucket = 0;
+        for (int b = 0; b < 8; ++b) {
+          bucket = bucket << 8 | (uint8_t) name[b];
+        }
+        out = formatFixed(out, bucket, 0);
+        *out++ = ' ';
+        *out++ = '{';
+      } else {
+        *out++ = ',';
+        *out++ = ' ';
+      }
+      name += 8;
+      nameLength -= 8;
+    } else if (i != 0) {
+      *out++ = ',';
+      *out++ = ' ';
+    }
+    memcpy(out, name, nameLength);
+    out += nameLength;
+    *out++ = '=';
+    out = formatFixed(out, entry.station.minTemp, INPUT_DECIMALS);
+    *out++ = '/';
+    out = formatFixed(out, entry.station.averageTemp10(), INPUT_DECIMALS);
+    *out++ = '/';
+    out = formatFixed(out, entry.station.maxTemp, INPUT_DECIMALS);
+    if (entries[i].histogram != nullptr) {
+      int percentiles[3];
+      histogramPercentiles(entries[i].histogram, entry.station.measurementCount, percentiles);
+      for (int p: percentiles) {
+        *out++ = '/';
+        out = formatFixed(out, p, INPUT_DECIMALS);
+      }
+    }
+  }
+  if (!bucketed || !entries.empty()) {
+    *out++ = '}';
+    *out++ = '\n';
+  }
+  buffer.resize(out - buffer.data());
+  return buffer;
+}
+
+/**
+ * Prints the result with a single write(2).
+*/
+void output(MergedStations& shards) {
+  std::string text = formatOutput(shards);
+  writeAll(STDOUT_FILENO, text.data(), text.size());
+}
+
+/**
+ * Branch-free parser for the 1BRC temperature format, [-+]?\d?\d\.\d followed
+ * by '\n'. The temperature is loaded as one little-endian word. '.' is the only
+ * byte among positions 1..3 with bit 4 clear, which gives its position; the
+ * digits are then shifted into fixed lanes and combined by one multiply.
+ * Stores the temperature in tenths and returns the index of the next row.
+ *
+ * Reads at most 8 bytes but never past endIdx.
+*/
+inline size_t parseTemperature(const char* data, size_t idx, size_t endIdx, int& result) {
+  uint64_t word = 0;
+  if (idx + 8 <= endIdx) {
+    memcpy(&word, data + idx, 8);
+  } else if (idx < endIdx) {
+    memcpy(&word, data + idx, endIdx - idx);
+  }
+
+  int dotBit = __builtin_ctzll(~word & 0x10101000);
+  // '+' and '-' both sort below '0'; only '-' negates.
+  uint64_t firstByte = word & 0xFF;
+  int64_t sign = -(int64_t) (firstByte == '-');
+  uint64_t signMask = -(uint64_t) (firstByte < '0');
+  uint64_t unsignedWord = word & ~(signMask & 0xFF);
+  uint64_t digits = (unsignedWord << (28 - dotBit)) & 0x0F000F0F00ULL;
+  int64_t absValue = ((digits * 0x640A0001) >> 32) & 0x3FF;
+  result = (int) ((absValue ^ sign) - sign);
+
+  return idx + (dotBit >> 3) + 3;
+}
+
+/**
+ * Everything a parse kernel needs to know about the input, as constants, so
+ * each instantiation compiles out the checks its format does not need. The
+ * 1BRC format (';', one decimal, no '+') gets the SWAR temperature parser;
+ * other formats use a scalar one. HISTOGRAM kernels also count every value
+ * for --percentiles, FILTER kernels drop rows rejected by ROW_FILTER
+ * before they reach the table, and TIMESTAMP kernels read a third column and
+ * key the table on (bucket, station).
+*/
+template <
+  char DELIMITER_,
+  int DECIMALS_,
+  bool PLUS_SIGN_,
+  bool STRICT_,
+  bool HISTOGRAM_ = false,
+  bool FILTER_ = false,
+  bool TIMESTAMP_ = false,
+  size_t MAX_NAME_LENGTH_ = 100>
+struct RowFormat {
+  static constexpr char DELIMITER = DELIMITER_;
+  static constexpr int DECIMALS = DECIMALS_;
+  static constexpr bool PLUS_SIGN = PLUS_SIGN_;
+  static constexpr bool STRICT = STRICT_;
+  static constexpr bool HISTOGRAM = HISTOGRAM_;
+  static constexpr bool FILTER = FILTER_;
+  static constexpr bool TIMESTAMP = TIMESTAMP_;
+  static constexpr size_t MAX_NAME_LENGTH = MAX_NAME_LENGTH_;
+  static constexpr bool ONE_BRC = DELIMITER == ';' && DECIMALS == 1 && !PLUS_SIGN;
+};
+
+/**
+ * Checks the row starting at rowStart against Format: a name of 1 to
+ * MAX_NAME_LENGTH bytes without '\n', the delimiter, [-+]?\d?\d\. followed
+ * by DECIMALS digits, with TIMESTAMP the delimiter and 1 to 16 digits, and
+ * '\n'. '+' is only accepted with PLUS_SIGN. The last row of the data may
+ * omit '\n'.
+*/
+template <typename Format>
+bool isValidRow(const char* data, size_t rowStart, size_t delimiterIdx, size_t endIdx) {
+  size_t nameLength = delimiterIdx - rowStart;
+  if (delimiterIdx >= endIdx || nameLength < 1 || nameLength > Format::MAX_NAME_LENGTH
+      || memchr(data + rowStart, '\n', nameLength) != nullptr) {
+    return false;
+  }
+
+  auto isDigit = [&](size_t idx) {
+    return idx < endIdx && data[idx] >= '0' && data[idx] <= '9';
+  };
+
+  size_t ptr = delimiterIdx + 1;
+  if (ptr < endIdx && (data[ptr] == '-' || (Format::PLUS_SIGN && data[ptr] == '+'))) {
+    ++ptr;
+  }
+  if (!isDigit(ptr++)) {
+    return false;
+  }
+  if (isDigit(ptr)) {
+    ++ptr;
+  }
+  if (ptr >= endIdx || data[ptr++] != '.') {
+    return false;
+  }
+  for (int i = 0; i < Format::DECIMALS; ++i) {
+    if (!isDigit(ptr++)) {
+      return false;
+    }
+  }
+  if constexpr (Format::TIMESTAMP) {
+    if (ptr >= endIdx || data[ptr++] != Format::DELIMITER) {
+      return false;
+    }
+    size_t digitsStart = ptr;
+    while (isDigit(ptr)) {
+      ++ptr;
+    }
+    if (ptr == digitsStart || ptr - digitsStart > 16) {
+      return false;
+    }
+  }
+  return ptr == endIdx || data[ptr] == '\n';
+}
+
+/**
+ * Parses the value of a row starting at idx into result, scaled by
+ * 10^DECIMALS, and returns the index after the byte that ends it: the next
+ * row, or with TIMESTAMP the timestamp. Extra fractional digits are dropped
+ * and missing ones count as zero.
+*/
+template <typename Format>
+inline size_t parseValue(const char* data, size_t idx, size_t endIdx, int& result) {
+  if constexpr (Format::ONE_BRC) {
+    return parseTemperature(data, idx, endIdx, result);
+  } else {
+    bool negative = false;
+    if (idx < endIdx && data[idx] == '-') {
+      negative = true;
+      ++idx;
+    } else if (Format::PLUS_SIGN && idx < endIdx && data[idx] == '+') {
+      ++idx;
+    }
+
+    auto isEnd = [&](char c) {
+      return c == '\n' || (Format::TIMESTAMP && c == Format::DELIMITER);
+    };
+    int value = 0;
+    while (idx < endIdx && data[idx] != '.' && !isEnd(data[idx])) {
+      value = value * 10 + (data[idx++] - '0');
+    }
+    int decimals = 0;
+    if (idx < endIdx && data[idx] == '.') {
+      ++idx;
+      for (; idx < endIdx && !isEnd(data[idx]); ++idx) {
+        if (decimals < Format::DECIMALS) {
+          value = value * 10 + (data[idx] - '0');
+          ++decimals;
+        }
+      }
+    }
+    for (; decimals < Format::DECIMALS; ++decimals) {
+      value *= 10;
+    }
+
+    result = negative ? -value : value;
+    return idx + 1;
+  }
+}
+
+/**
+ * Parses the unsigned decimal timestamp at idx and returns the index of the
+ * next row. Works on 8 bytes at a time: the first non-digit byte of the word
+ * gives the digit count, the digits are shifted to the top as if zero
+ * padded, and three multiply-and-shift steps combine them into one number.
+ * Reads at most 8 bytes at a time but never past endIdx.
+*/
+inline size_t parseTimestamp(const char* data, size_t idx, size_t endIdx, int64_t& result) {
+  static constexpr uint64_t POWERS_OF_10[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+  };
+  uint64_t value = 0;
+  while (true) {
+    uint64_t word = 0;
+    if (idx + 8 <= endIdx) {
+      memcpy(&word, data + idx, 8);
+    } else if (idx < endIdx) {
+      memcpy(&word, data + idx, endIdx - idx);
+    }
+
+    // Digit values per byte; a byte is a digit iff its value is below 10.
+    uint64_t lanes = word ^ 0x3030303030303030ULL;
+    uint64_t nonDigits = (((lanes & 0x7F7F7F7F7F7F7F7FULL) + 0x7676767676767676ULL) | lanes)
+      & 0x8080808080808080ULL;
+    int digits = nonDigits == 0 ? 8 : __builtin_ctzll(nonDigits) >> 3;
+    if (digits > 0) {
+      lanes <<= 8 * (8 - digits);
+      lanes = ((lanes & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+      lanes = ((lanes & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+      lanes = ((lanes & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+      value = value * POWERS_OF_10[digits] + lanes;
+    }
+    idx += digits;
+    if (digits < 8) {
+      break;
+    }
+  }
+
+  result = (int64_t) value;
+  return idx + 1;
+}
+
+/**
+ * Builds the table key of a timestamped row in key: the start of its time
+ * bucket as 8 big-endian bytes, then the name. Byte-wise order of keys is
+ * then bucket order first, which output() relies on.
+*/
+inline void timeBucketKey(std::string& key, const char* name, size_t length, int64_t timestamp) {
+  uint64_t bucket = timestamp - timestamp % TIME_BUCKET_SECONDS;
+  key.resize(8 + length);
+  for (int i = 0; i < 8; ++i) {
+    key[i] = (char) (bucket >> (56 - 8 * i));
+  }
+  memcpy(key.data() + 8, name, length);
+}
+
+/**
+ * Set by the first malformed row. Workers stop claiming chunks and main exits
+ * with 1 once the pool is idle; exiting from a worker would run static
+ * destructors under the other workers' feet.
+*/
+std::atomic<bool> MALFORMED_INPUT{false};
+
+/**
+ * Reports a row that does not match the input format and returns where the
+ * caller continues. Normally that is endIdx, abandoning the chunk, and only
+ * the first bad row is reported. Under --serve one bad append must not take
+ * the daemon down, so every bad row is reported and skipped.
+*/
+size_t reportMalformedRow(const char* data, size_t rowStart, size_t endIdx) {
+  bool serving = !SERVE_SOCKET.empty();
+  if (!serving && MALFORMED_INPUT.exchange(true)) {
+    return endIdx;
+  }
+  size_t rowEnd = rowStart;
+  while (rowEnd < endIdx && data[rowEnd] != '\n') {
+    ++rowEnd;
+  }
+  std::cerr << "Malformed row: \"" << std::string(data + rowStart, rowEnd - rowStart)
+    << "\"" << std::endl;
+  return serving ? std::min(rowEnd + 1, endIdx) : endIdx;
+}
+
+/**
+ * Delimiter scanning works on 64-byte blocks. For each block we build one
+ * bitmask per delimiter, bit i set when block[i] matches, and callers walk the
+ * masks with ctz/clz instead of testing bytes one at a time.
+*/
+constexpr size_t SCAN_BLOCK_SIZE = 64;
+
+struct BlockMasks {
+  uint64_t delimiters;
+  uint64_t newlines;
+};
+
+using ScanBlockFunc = BlockMasks (*)(const char* block);
+
+/**
+ * Portable fallback: 8 bytes per step. A byte of x is zero iff the high bit
+ * of ~(((x & 0x7f..) + 0x7f..) | x) is set, and that is exact per byte (no
+ * false positives from borrows). The 8 high bits are then gathered into one
+ * byte with a multiply.
+*/
+inline uint64_t swarMatchByte(uint64_t word, uint64_t pattern) {
+  const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+  uint64_t x = word ^ pattern;
+  uint64_t highBits = ~(((x & low7) + low7) | x | low7);
+  return ((highBits >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+template <char DELIMITER>
+BlockMasks scanBlockSwar(const char* block) {
+  const uint64_t delimiters = 0x0101010101010101ULL * (uint8_t) DELIMITER;
+  const uint64_t newlines = 0x0A0A0A0A0A0A0A0AULL;
+
+  BlockMasks masks = {0, 0};
+  for (size_t i = 0; i < SCAN_BLOCK_SIZE; i += 8) {
+    uint64_t word;
+    memcpy(&word, block + i, 8);
+    masks.delimiters |= swarMatchByte(word, delimiters) << i;
+    masks.newlines |= swarMatchByte(word, newlines) << i;
+  }
+  return masks;
+}
+
+#if defined(__x86_64__)
+template <char DELIMITER>
+BlockMasks scanBlockSse2(const char* block) {
+  const __m128i delimiters = _mm_set1_epi8(DELIMITER);
+  const __m128i newlines = _mm_set1_epi8('\n');
+
+  BlockMasks masks = {0, 0};
+  for (size_t i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) (block + i));
+    uint64_t delims = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, delimiters));
+    uint64_t lines = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newlines));
+    masks.delimiters |= delims << i;
+    masks.newlines |= lines << i;
+  }
+  return masks;
+}
+
+template <char DELIMITER>
+__attribute__((target("avx2")))
+BlockMasks scanBlockAvx2(const char* block) {
+  const __m256i delimiters = _mm256_set1_epi8(DELIMITER);
+  const __m256i newlines = _mm256_set1_epi8('\n');
+
+  __m256i lo = _mm256_loadu_si256((const __m256i*) block);
+  __m256i hi = _mm256_loadu_si256((const __m256i*) (block + 32));
+
+  BlockMasks masks;
+  masks.delimiters = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, delimiters))
+    | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, delimiters)) << 32;
+  masks.newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newlines))
+    | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newlines)) << 32;
+  return masks;
+}
+#endif
+
+/**
+ * Picks the widest block scanner the CPU supports, once at startup.
+*/
+template <char DELIMITER>
+ScanBlockFunc selectScanBlock() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return scanBlockAvx2<DELIMITER>;
+  }
+  return scanBlockSse2<DELIMITER>;
+#else
+  return scanBlockSwar<DELIMITER>;
+#endif
+}
+
+template <char DELIMITER>
+ScanBlockFunc scanBlock = selectScanBlock<DELIMITER>();
+
+/**
+ * Scans data[startIdx, endIdx) as a block, padding with zeros when fewer
+ * than SCAN_BLOCK_SIZE bytes are left so we never read past endIdx. Callers
+ * that only need newlines use the default delimiter.
+*/
+template <char DELIMITER = ';'>
+inline BlockMasks scanBlockAt(const char* data, size_t startIdx, size_t endIdx) {
+  if (endIdx - startIdx >= SCAN_BLOCK_SIZE) {
+    return scanBlock<DELIMITER>(data + startIdx);
+  }
+
+  char padded[SCAN_BLOCK_SIZE] = {0};
+  memcpy(padded, data + startIdx, endIdx - startIdx);
+  return scanBlock<DELIMITER>(padded);
+}
+
+/**
+ * Feeds delimiter positions to the row loop. Keeps the masks of the current
+ * block and only scans the next block once every delimiter in it has been
+ * used.
+*/
+template <char DELIMITER>
+class DelimiterScanner {
+public:
+  DelimiterScanner(const char* data, size_t startIdx, size_t endIdx)
+    : data(data), endIdx(endIdx) {
+    load(startIdx);
+  }
+
+  /**
+   * Index of the first delimiter at or after from, or endIdx if there is
+   * none. from must not go backwards between calls.
+  */
+  size_t nextDelimiter(size_t from) {
+    while (true) {
+      size_t offset = from - blockStart;
+      if (offset < SCAN_BLOCK_SIZE) {
+        uint64_t remaining = masks.delimiters >> offset;
+        if (remaining != 0) {
+          return from + __builtin_ctzll(remaining);
+        }
+        from = blockStart + SCAN_BLOCK_SIZE;
+      }
+      if (from >= endIdx) {
+        return endIdx;
+      }
+      load(from);
+    }
+  }
+
+private:
+  void load(size_t idx) {
+    blockStart = idx;
+    masks = scanBlockAt<DELIMITER>(data, idx, endIdx);
+  }
+
+  const char* data;
+  size_t endIdx;
+  size_t blockStart;
+  BlockMasks masks;
+};
+
+/**
+ * Find the index of last \n in data, in the range of [startIdx, endIdx),
+ * or endIdx if there is none
+*/
+size_t findLastRowEnd(const char* data, size_t startIdx, size_t endIdx) {
+  size_t blockEnd = endIdx;
+  while (blockEnd > startIdx) {
+    size_t blockStart = blockEnd - std::min(SCAN_BLOCK_SIZE, blockEnd - startIdx);
+    uint64_t newlines = scanBlockAt(data, blockStart, blockEnd).newlines;
+    if (newlines != 0) {
+      return blockStart + 63 - __builtin_clzll(newlines);
+    }
+    blockEnd = blockStart;
+  }
+  return endIdx;
+}
+
+/**
+ * Find the index of first \n in data, in the range of [startIdx, endIdx)
+*/
+size_t findFirstRowEnd(const char* data, size_t startIdx, size_t endIdx) {
+  for (size_t blockStart = startIdx; blockStart < endIdx; blockStart += SCAN_BLOCK_SIZE) {
+    uint64_t newlines = scanBlockAt(data, blockStart, endIdx).newlines;
+    if (newlines != 0) {
+      return blockStart + __builtin_ctzll(newlines);
+    }
+  }
+  return endIdx;
+}
+
+/**
+ * Row predicates from --station, --prefix, --min-temp and --max-temp. A row
+ * passes if its value is within the bounds and its name is one of the
+ * stations or starts with one of the prefixes. The station set sits behind a
+ * small Bloom filter keyed by the row hash that is computed anyway, so most
+ * rejected names cost two bit tests and never touch the table or the set.
+*/
+class RowFilter {
+public:
+  void addStation(const std::string& name) {
+    names.push_back(name);
+    stations.insert(names.back());
+    uint32_t hash = hashName(name.data(), name.size());
+    bloom[bloomBit(hash, 0) / 64] |= 1ULL << (bloomBit(hash, 0) % 64);
+    bloom[bloomBit(hash, 1) / 64] |= 1ULL << (bloomBit(hash, 1) % 64);
+  }
+
+  void addPrefix(const std::string& prefix) {
+    prefixes.push_back(prefix);
+  }
+
+  void setValueRange(int minimum, int maximum) {
+    minValue = minimum;
+    maxValue = maximum;
+  }
+
+  bool active() const {
+    return !stations.empty() || !prefixes.empty() || minValue != INT_MIN || maxValue != INT_MAX;
+  }
+
+  bool acceptsValue(int value) const {
+    return value >= minValue && value <= maxValue;
+  }
+
+  bool acceptsName(const char* name, size_t length, uint32_t hash) const {
+    if (stations.empty() && prefixes.empty()) {
+      return true;
+    }
+    if (mayContain(hash) && stations.count(std::string_view(name, length)) != 0) {
+      return true;
+    }
+    for (const std::string& prefix: prefixes) {
+      if (length >= prefix.size() && memcmp(name, prefix.data(), prefix.size()) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  static constexpr size_t BLOOM_BITS = 1 << 14;
+
+  static size_t bloomBit(uint32_t hash, int probe) {
+    uint32_t mixed = probe == 0 ? hash : hash * 0x9E3779B1u;
+    return mixed >> (32 - 14);
+  }
+
+  bool mayContain(uint32_t hash) const {
+    return (bloom[bloomBit(hash, 0) / 64] >> (bloomBit(hash, 0) % 64) & 1)
+      && (bloom[bloomBit(hash, 1) / 64] >> (bloomBit(hash, 1) % 64) & 1);
+  }
+
+  uint64_t bloom[BLOOM_BITS / 64] = {};
+  std::deque<std::string> names; // owns the bytes the set points at
+  std::unordered_set<std::string_view> stations;
+  std::vector<std::string> prefixes;
+  int minValue = INT_MIN;
+  int maxValue = INT_MAX;
+};
+
+RowFilter ROW_FILTER;
+
+/**
+ * Handle the rows in data with range [startIdx, endIdx), parsed as Format.
+ * startIdx must be the start of a row; the last row may miss its trailing \n.
+*/
+template <typename Format>
+void handleChunkAs(
+    const char * data,
+    size_t startIdx,
+    size_t endIdx,
+    Stations& stations)
+{
+  size_t ptr = startIdx;
+  DelimiterScanner<Format::DELIMITER> scanner(data, startIdx, endIdx);
+  STATS(++workerStats->chunks; workerStats->bytes += endIdx - startIdx;)
+  std::string key; // (bucket, name) of the current row with TIMESTAMP
+
+  while (ptr < endIdx) {
+    STATS(uint64_t rowTicks = readTicks(); ++workerStats->rows;)
+    // get name
+    size_t rowStart = ptr;
+    const char *nameStart = data + ptr;
+    ptr = scanner.nextDelimiter(ptr);
+    size_t nameLength = data + ptr - nameStart;
+
+    if constexpr (Format::STRICT) {
+      if (!isValidRow<Format>(data, rowStart, ptr, endIdx)) {
+        ptr = reportMalformedRow(data, rowStart, endIdx);
+        continue;
+      }
+    }
+
+    ++ptr; // consume the delimiter
+    int temperature10 = -1000;
+    ptr = parseValue<Format>(data, ptr, endIdx, temperature10);
+    if constexpr (Format::TIMESTAMP) {
+      // Even unchecked rows need a timestamp, or they would land in the
+      // bucket of 1970-01-01.
+      if constexpr (!Format::STRICT) {
+        if (ptr >= endIdx || data[ptr - 1] != Format::DELIMITER
+            || (unsigned) (data[ptr] - '0') > 9) {
+          ptr = reportMalformedRow(data, rowStart, endIdx);
+          continue;
+        }
+      }
+      int64_t timestamp;
+      ptr = parseTimestamp(data, ptr, endIdx, timestamp);
+      timeBucketKey(key, nameStart, nameLength, timestamp);
+      nameStart = key.data();
+      nameLength = key.size();
+    }
+    STATS(uint64_t parsedTicks = readTicks();)
+    STATS(workerStats->scanTicks += parsedTicks - rowTicks;)
+
+    if constexpr (Format::FILTER) {
+      if (!ROW_FILTER.acceptsValue(temperature10)) {
+        continue;
+      }
+    }
+    uint32_t hash = hashName(nameStart, nameLength);
+    if constexpr (Format::FILTER) {
+      if (!ROW_FILTER.acceptsName(nameStart, nameLength, hash)) {
+        continue;
+      }
+    }
+
+    if constexpr (Format::HISTOGRAM) {
+      stations.addWithHistogram(nameStart, nameLength, hash, temperature10);
+    } else {
+      stations.findOrInsert(nameStart, nameLength, hash).addMeasurement(temperature10);
+    }
+    STATS(workerStats->hashTicks += readTicks() - parsedTicks;)
+  }
+}
+
+/**
+ * Calls visit with a RowFormat value for the configured delimiter, decimals,
+ * strictness, percentiles and filter, returning its result. Only these
+ * combinations have kernels; parseArgs rejects the others.
+*/
+template <char DELIMITER, int DECIMALS, bool STRICT, bool HISTOGRAM, typename Visitor>
+auto withFilter(Visitor&& visit) {
+  constexpr bool PLUS_SIGN = !(DELIMITER == ';' && DECIMALS == 1);
+  return ROW_FILTER.active()
+    ? visit(RowFormat<DELIMITER, DECIMALS, PLUS_SIGN, STRICT, HISTOGRAM, true>{})
+    : visit(RowFormat<DELIMITER, DECIMALS, PLUS_SIGN, STRICT, HISTOGRAM, false>{});
+}
+
+template <char DELIMITER, int DECIMALS, bool STRICT, typename Visitor>
+auto withHistogram(Visitor&& visit) {
+  if constexpr (DECIMALS == 1) {
+    if (PERCENTILES) {
+      return withFilter<DELIMITER, DECIMALS, STRICT, true>(visit);
+    }
+  }
+  return withFilter<DELIMITER, DECIMALS, STRICT, false>(visit);
+}
+
+/**
+ * Time-bucketed rows get their own kernels, without percentiles or filters,
+ * so the two-column kernels stay as they are.
+*/
+template <char DELIMITER, int DECIMALS, bool STRICT, typename Visitor>
+auto withTimestamp(Visitor&& visit) {
+  constexpr bool PLUS_SIGN = !(DELIMITER == ';' && DECIMALS == 1);
+  if (TIME_BUCKET_SECONDS > 0) {
+    return visit(RowFormat<DELIMITER, DECIMALS, PLUS_SIGN, STRICT, false, false, true>{});
+  }
+  return withHistogram<DELIMITER, DECIMALS, STRICT>(visit);
+}
+
+template <char DELIMITER, int DECIMALS, typename Visitor>
+auto withStrictness(Visitor&& visit) {
+  return STRICT_PARSING
+    ? withTimestamp<DELIMITER, DECIMALS, true>(visit)
+    : withTimestamp<DELIMITER, DECIMALS, false>(visit);
+}
+
+template <char DELIMITER, typename Visitor>
+auto withDecimals(Visitor&& visit) {
+  return INPUT_DECIMALS == 2
+    ? withStrictness<DELIMITER, 2>(visit)
+    : withStrictness<DELIMITER, 1>(visit);
+}
+
+template <typename Visitor>
+auto withRowFormat(Visitor&& visit) {
+  switch (INPUT_DELIMITER) {
+  case ',':
+    return withDecimals<','>(visit);
+  case '|':
+    return withDecimals<'|'>(visit);
+  case '\t':
+    return withDecimals<'\t'>(visit);
+  default:
+    return withDecimals<';'>(visit);
+  }
+}
+
+using ChunkFunc = void (*)(const char* data, size_t startIdx, size_t endIdx, Stations& stations);
+
+/**
+ * The parse kernel for the configured input format, selected in main once
+ * the options are known.
+*/
+ChunkFunc handleChunk = handleChunkAs<RowFormat<';', 1, false, false>>;
+
+ChunkFunc selectChunkHandler() {
+  return withRowFormat([](auto format) -> ChunkFunc {
+    return handleChunkAs<decltype(format)>;
+  });
+}
+
+/**
+ * Persistent worker threads, created once per run. run() hands the same job
+ * to every worker and blocks until all of them have returned from it.
+*/
+class WorkerPool {
+public:
+  explicit WorkerPool(int threadCount) {
+    STATS(WORKER_STATS.resize(threadCount);)
+    for (int i = 0; i < threadCount; ++i) {
+      threads.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t: threads) {
+      t.join();
+    }
+  }
+
+  int size() const {
+    return threads.size();
+  }
+
+  void run(const std::function<void(int workerId)>& job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    currentJob = &job;
+    running = threads.size();
+    ++generation;
+    wake.notify_all();
+    done.wait(lock, [this] { return running == 0; });
+    currentJob = nullptr;
+
+    // Time each worker spent waiting for the slowest one.
+    STATS(uint64_t barrierTicks = readTicks();)
+    STATS(for (auto& stats: WORKER_STATS) stats.idleTicks += barrierTicks - stats.jobEndTicks;)
+  }
+
+private:
+  void workerLoop(int workerId) {
+    STATS(workerStats = &WORKER_STATS[workerId];)
+    uint64_t seenGeneration = 0;
+    while (true) {
+      const std::function<void(int)>* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+        if (stopping) {
+          return;
+        }
+        seenGeneration = generation;
+        job = currentJob;
+      }
+
+      (*job)(workerId);
+      STATS(workerStats->jobEndTicks = readTicks();)
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running == 0) {
+        done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(int)>* currentJob = nullptr;
+  uint64_t generation = 0;
+  int running = 0;
+  bool stopping = false;
+};
+
+/**
+ * Hands out row-aligned chunks of data[beginIdx, endIdx), which must hold
+ * whole rows. Workers claim chunkSize byte ranges from a shared atomic
+ * cursor, so a fast worker simply claims more chunks. Both ends of a claimed
+ * range are moved forward to the next row start; neighbouring chunks compute
+ * the same boundary and every row is handled exactly once. No more chunks are
+ * handed out once a malformed row was found.
+*/
+class ChunkCursor {
+public:
+  ChunkCursor(const char* data, size_t beginIdx, size_t endIdx, size_t chunkSize = CHUNK_SIZE)
+    : data(data), beginIdx(beginIdx), endIdx(endIdx), chunkSize(chunkSize), cursor(beginIdx) {}
+
+  bool next(size_t& chunkStart, size_t& chunkEnd) {
+    while (!MALFORMED_INPUT.load(std::memory_order_relaxed)) {
+      size_t claimed = cursor.fetch_add(chunkSize, std::memory_order_relaxed);
+      if (claimed >= endIdx) {
+        return false;
+      }
+
+      chunkStart = alignToRowStart(claimed);
+      chunkEnd = alignToRowStart(std::min(claimed + chunkSize, endIdx));
+      if (chunkStart < chunkEnd) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  size_t alignToRowStart(size_t idx) {
+    if (idx == beginIdx || idx == endIdx) {
+      return idx;
+    }
+    return std::min(findFirstRowEnd(data, idx - 1, endIdx) + 1, endIdx);
+  }
+
+  const char* data;
+  size_t beginIdx;
+  size_t endIdx;
+  size_t chunkSize;
+  std::atomic<size_t> cursor;
+};
+
+/**
+ * NUMA placement for --numa. Workers are spread over the nodes and pinned to
+ * their node's CPUs, each node parses its own region of the file with pages
+ * bound to it, and tables are merged per node before the global merge.
+ * Machines without the sysfs node topology are treated as one node.
+*/
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+struct NumaLayout {
+  std::vector<NumaNode> nodes;
+  std::vector<int> workerNode; // index into nodes, per worker
+  std::vector<int> workerCpu;
+};
+
+NumaLayout NUMA_LAYOUT;
+
+/**
+ * Parses the kernel's list format, e.g. "0-3,8,10-11".
+*/
+std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+      int first = std::atoi(range.c_str());
+      int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+std::string readFirstLine(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+NumaLayout readNumaLayout(int threadCount) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    for (int cpu = 0; cpu < threadCount && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, &allowed);
+    }
+  }
+
+  NumaLayout layout;
+  std::string sysfs = "/sys/devices/system/node/";
+  for (int id: parseCpuList(readFirstLine(sysfs + "online"))) {
+    NumaNode node{id, {}};
+    for (int cpu: parseCpuList(readFirstLine(sysfs + "node" + std::to_string(id) + "/cpulist"))) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    if (!node.cpus.empty()) {
+      layout.nodes.push_back(node);
+    }
+  }
+
+  if (layout.nodes.empty()) {
+    NumaNode node{0, {}};
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    layout.nodes.push_back(node);
+  }
+
+  // Round-robin, so a partial thread count still uses every node.
+  std::vector<size_t> nodeWorkers(layout.nodes.size());
+  for (int i = 0; i < threadCount; ++i) {
+    int n = i % layout.nodes.size();
+    const std::vector<int>& cpus = layout.nodes[n].cpus;
+    layout.workerNode.push_back(n);
+    layout.workerCpu.push_back(cpus[nodeWorkers[n]++ % cpus.size()]);
+  }
+  return layout;
+}
+
+/**
+ * Pins every worker to its CPU and has it allocate its own table, so the
+ * table's pages are first touched, and placed, on the worker's node.
+*/
+void pinWorkers(WorkerPool& pool, std::vector<Stations>& threadStations) {
+  if (!NUMA_AWARE) {
+    return;
+  }
+  NUMA_LAYOUT = readNumaLayout(pool.size());
+  const NumaLayout& layout = NUMA_LAYOUT;
+  if (PRINT_STATS) {
+    std::cerr << "numa: " << layout.nodes.size() << " node(s)" << std::endl;
+  }
+
+  pool.run([&](int workerId) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(layout.workerCpu[workerId], &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    threadStations[workerId] = Stations();
+  });
+}
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+/**
+ * Asks the kernel to place, and move, the pages of data[0, size) on node.
+ * Best effort: the pages stay where they are if this fails.
+*/
+void bindToNode(const char* data, size_t size, int node) {
+#ifdef SYS_mbind
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t) data & ~(pageSize - 1);
+  uintptr_t end = (uintptr_t) data + size;
+  if (end <= begin) {
+    return;
+  }
+
+  constexpr size_t MASK_BITS = 1024;
+  unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {};
+  if (node < 0 || (size_t) node >= MASK_BITS) {
+    return;
+  }
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, mask, MASK_BITS + 1, MPOL_MF_MOVE);
+#endif
+}
+
+/**
+ * Like handleMappedFile, but the range is split into one row-aligned region
+ * per node, sized by the node's worker count and bound to it. Workers drain
+ * their own node's region first and then steal chunks from the others.
+*/
+void handleNumaMappedFile(
+    const char *fileData,
+    size_t beginIdx,
+    size_t endIdx,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations
+) {
+  const NumaLayout& layout = NUMA_LAYOUT;
+  size_t nodeCount = layout.nodes.size();
+  std::vector<size_t> nodeWorkers(nodeCount);
+  for (int node: layout.workerNode) {
+    ++nodeWorkers[node];
+  }
+
+  std::vector<std::unique_ptr<ChunkCursor>> cursors;
+  size_t regionStart = beginIdx;
+  size_t workersBefore = 0;
+  for (size_t n = 0; n < nodeCount; ++n) {
+    workersBefore += nodeWorkers[n];
+    size_t regionEnd = beginIdx + (endIdx - beginIdx) * workersBefore / layout.workerNode.size();
+    if (regionEnd > regionStart && regionEnd < endIdx) {
+      regionEnd = std::min(findFirstRowEnd(fileData, regionEnd - 1, endIdx) + 1, endIdx);
+    }
+    regionEnd = std::max(regionStart, regionEnd);
+    if (n + 1 == nodeCount) {
+      regionEnd = endIdx;
+    }
+
+    bindToNode(fileData + regionStart, regionEnd - regionStart, layout.nodes[n].id);
+    cursors.push_back(std::make_unique<ChunkCursor>(fileData, regionStart, regionEnd));
+    regionStart = regionEnd;
+  }
+
+  pool.run([&](int workerId) {
+    size_t home = layout.workerNode[workerId];
+    size_t chunkStart, chunkEnd;
+    for (size_t i = 0; i < nodeCount; ++i) {
+      ChunkCursor& chunks = *cursors[(home + i) % nodeCount];
+      while (chunks.next(chunkStart, chunkEnd)) {
+        handleChunk(fileData, chunkStart, chunkEnd, threadStations[workerId]);
+      }
+    }
+  });
+}
+
+/**
+ * First step of the NUMA merge: the first worker of every node merges that
+ * node's thread tables into a node table it allocates itself. The node
+ * tables borrow names from the thread tables.
+*/
+void mergePerNode(
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations,
+    std::vector<Stations>& nodeStations
+) {
+  const NumaLayout& layout = NUMA_LAYOUT;
+  nodeStations.resize(layout.nodes.size());
+  pool.run([&](int workerId) {
+    int node = layout.workerNode[workerId];
+    for (int w = 0; w < workerId; ++w) {
+      if (layout.workerNode[w] == node) {
+        return;
+      }
+    }
+
+    STATS(uint64_t startTicks = readTicks();)
+    Stations nodeTable;
+    for (size_t w = workerId; w < threadStations.size(); ++w) {
+      if (layout.workerNode[w] != node) {
+        continue;
+      }
+      for (const auto& entry: threadStations[w]) {
+        nodeTable.mergeBorrowed(threadStations[w], entry);
+      }
+    }
+    nodeStations[node] = std::move(nodeTable);
+    STATS(workerStats->mergeTicks += readTicks() - startTicks;)
+  });
+}
+
+/**
+ * Handle the rows of the mapped file in [beginIdx, endIdx); beginIdx must be
+ * a row start. Workers pull chunks from one cursor spanning the range, so
+ * there is no barrier until it is done.
+*/
+void handleMappedFile(
+    const char *fileData,
+    size_t beginIdx,
+    size_t endIdx,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations
+) {
+  if (NUMA_AWARE) {
+    handleNumaMappedFile(fileData, beginIdx, endIdx, pool, threadStations);
+    return;
+  }
+
+  ChunkCursor chunks(fileData, beginIdx, endIdx);
+  pool.run([&](int workerId) {
+    size_t chunkStart, chunkEnd;
+    while (chunks.next(chunkStart, chunkEnd)) {
+      handleChunk(fileData, chunkStart, chunkEnd, threadStations[workerId]);
+    }
+  });
+}
+
+/**
+ * Unbounded queue between the streaming reader and parser threads. pop()
+ * blocks until an item arrives or the queue is closed and drained.
+*/
+template <typename T>
+class BlockingQueue {
+public:
+  void push(T item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      items.push_back(std::move(item));
+    }
+    ready.notify_one();
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    return true;
+  }
+
+  bool tryPop(T& item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    ready.notify_all();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<T> items;
+  bool closed = false;
+};
+
+/**
+ * Source of reads for the streaming path. submit() queues a read of up to len
+ * bytes at offset into buf, tagged with id; wait() blocks until one queued read
+ * has finished and reports its id and byte count (0 at end of input, -errno on
+ * failure). Reads may finish out of order.
+*/
+class ReadBackend {
+public:
+  virtual ~ReadBackend() = default;
+  virtual void submit(int id, char* buf, size_t len, size_t offset) = 0;
+  virtual void wait(int& id, ssize_t& result) = 0;
+};
+
+/**
+ * Blocking pread(2), one read at a time on the reader thread. The parser
+ * threads still overlap with it, since they work on earlier buffers.
+*/
+class PreadBackend: public ReadBackend {
+public:
+  explicit PreadBackend(int fd): fd(fd) {}
+
+  void submit(int id, char* buf, size_t len, size_t offset) override {
+    pending.push_back({id, buf, len, offset});
+  }
+
+  void wait(int& id, ssize_t& result) override {
+    Request request = pending.front();
+    pending.pop_front();
+
+    id = request.id;
+    size_t done = 0;
+    while (done < request.len) {
+      ssize_t n = readSome(request.buf + done, request.len - done, request.offset + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        result = -errno;
+        return;
+      }
+      if (n == 0) {
+        break;
+      }
+      done += n;
+    }
+    result = done;
+  }
+
+protected:
+  virtual ssize_t readSome(char* buf, size_t len, size_t offset) {
+    return pread(fd, buf, len, offset);
+  }
+
+  int fd;
+
+private:
+  struct Request {
+    int id;
+    char* buf;
+    size_t len;
+    size_t offset;
+  };
+
+  std::deque<Request> pending;
+};
+
+/**
+ * For stdin and pipes, which cannot seek: reads run with read(2) in
+ * submission order and offsets are ignored. A read keeps going until its
+ * buffer is full, so short pipe reads are not mistaken for end of input.
+*/
+class SequentialReadBackend: public PreadBackend {
+public:
+  using PreadBackend::PreadBackend;
+
+protected:
+  ssize_t readSome(char* buf, size_t len, size_t) override {
+    return read(fd, buf, len);
+  }
+};
+
+#ifdef HAVE_IO_URING
+/**
+ * io_uring through the raw syscalls, so there is no liburing dependency.
+ * Every buffer of the ring can have a read in flight. Short reads before end
+ * of file are resubmitted for the remainder, so callers see full buffers.
+*/
+class UringBackend: public ReadBackend {
+public:
+  UringBackend(int fd, size_t fileSize): fd(fd), fileSize(fileSize) {}
+
+  ~UringBackend() override {
+    if (sqes != nullptr) {
+      munmap(sqes, sqeCount * sizeof(io_uring_sqe));
+    }
+    if (cqRing != nullptr && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != nullptr) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+      close(ringFd);
+    }
+  }
+
+  bool init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+      return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+    cqRing = singleMmap ? sqRing : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+    sqeCount = params.sq_entries;
+    sqes = (io_uring_sqe*) mapRing(sqeCount * sizeof(io_uring_sqe), IORING_OFF_SQES);
+    if (sqRing == nullptr || cqRing == nullptr || sqes == nullptr) {
+      return false;
+    }
+
+    sqTail = (unsigned*) (sqRing + params.sq_off.tail);
+    sqMask = *(unsigned*) (sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned*) (sqRing + params.sq_off.array);
+    cqHead = (unsigned*) (cqRing + params.cq_off.head);
+    cqTail = (unsigned*) (cqRing + params.cq_off.tail);
+    cqMask = *(unsigned*) (cqRing + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) (cqRing + params.cq_off.cqes);
+    return true;
+  }
+
+  void submit(int id, char* buf, size_t len, size_t offset) override {
+    if ((size_t) id >= requests.size()) {
+      requests.resize(id + 1);
+    }
+    requests[id] = {buf, len, offset, 0};
+    queueRead(id);
+  }
+
+  void wait(int& id, ssize_t& result) override {
+    while (true) {
+      unsigned head = *cqHead;
+      if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        continue;
+      }
+
+      io_uring_cqe& cqe = cqes[head & cqMask];
+      int completedId = cqe.user_data;
+      int res = cqe.res;
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+      Request& request = requests[completedId];
+      if (res > 0) {
+        request.done += res;
+        if (request.done < request.len && request.offset + request.done < fileSize) {
+          queueRead(completedId);
+          continue;
+        }
+      }
+
+      id = completedId;
+      result = res < 0 ? res : request.done;
+      return;
+    }
+  }
+
+private:
+  struct Request {
+    char* buf;
+    size_t len;
+    size_t offset;
+    size_t done;
+  };
+
+  char* mapRing(size_t size, off_t offset) {
+    void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ringFd, offset);
+    return ring == MAP_FAILED ? nullptr : (char*) ring;
+  }
+
+  void queueRead(int id) {
+    Request& request = requests[id];
+    unsigned tail = *sqTail;
+    unsigned idx = tail & sqMask;
+
+    io_uring_sqe& sqe = sqes[idx];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t) (request.buf + request.done);
+    sqe.len = request.len - request.done;
+    sqe.off = request.offset + request.done;
+    sqe.user_data = id;
+    sqArray[idx] = idx;
+
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0);
+  }
+
+  int fd;
+  size_t fileSize;
+  int ringFd = -1;
+  char* sqRing = nullptr;
+  char* cqRing = nullptr;
+  size_t sqRingSize = 0;
+  size_t cqRingSize = 0;
+  io_uring_sqe* sqes = nullptr;
+  unsigned sqeCount = 0;
+  unsigned* sqTail = nullptr;
+  unsigned sqMask = 0;
+  unsigned* sqArray = nullptr;
+  unsigned* cqHead = nullptr;
+  unsigned* cqTail = nullptr;
+  unsigned cqMask = 0;
+  io_uring_cqe* cqes = nullptr;
+  std::vector<Request> requests;
+};
+#endif
+
+/**
+ * Streams the input through a ring of aligned buffers instead of mapping it.
+ * Each buffer has a small carry area in front of the part that is read into.
+ * Reads are finished in file order: the bytes after the last '\n' of one read
+ * are copied in front of the next read, so every buffer handed to a parser
+ * thread holds whole rows only.
+*/
+class StreamingReader {
+public:
+  static constexpr size_t CARRY_SIZE = 4096;
+
+  StreamingReader(ReadBackend& backend, size_t fileSize, int bufferCount)
+    : backend(backend),
+      fileSize(fileSize),
+      buffers(bufferCount),
+      results(bufferCount),
+      finished(bufferCount, false) {
+    for (auto& buffer: buffers) {
+      void* memory = nullptr;
+      if (posix_memalign(&memory, CARRY_SIZE, CARRY_SIZE + STREAM_BUFFER_SIZE) != 0) {
+        throw std::bad_alloc();
+      }
+      buffer.memory = (char*) memory;
+    }
+  }
+
+  ~StreamingReader() {
+    for (auto& buffer: buffers) {
+      free(buffer.memory);
+    }
+  }
+
+  /**
+   * Reads the whole input, parsing it on the pool. Returns false on a read
+   * error.
+  */
+  bool run(WorkerPool& pool, std::vector<Stations>& threadStations) {
+    bool ok = true;
+    std::thread reader([&] {
+      ok = readAll();
+      readyBuffers.close();
+    });
+
+    pool.run([&](int workerId) {
+      int id;
+      while (readyBuffers.pop(id)) {
+        Buffer& buffer = buffers[id];
+        // After a malformed row, keep draining so the reader can finish.
+        if (!MALFORMED_INPUT.load(std::memory_order_relaxed)) {
+          handleChunk(buffer.memory, buffer.rowsStart, buffer.rowsEnd, threadStations[workerId]);
+        }
+        freeBuffers.push(id);
+      }
+    });
+
+    reader.join();
+    return ok;
+  }
+
+private:
+  struct Buffer {
+    char* memory = nullptr;
+    size_t rowsStart = 0;
+    size_t rowsEnd = 0;
+  };
+
+  bool readAll() {
+    for (int id = 0; id < (int) buffers.size(); ++id) {
+      freeBuffers.push(id);
+    }
+
+    size_t nextOffset = 0;
+    bool endOfInput = false;
+    std::deque<int> inOrder;
+    std::string carry;
+
+    while (true) {
+      // Keep a read in flight for every free buffer.
+      while (!endOfInput && nextOffset < fileSize) {
+        int id = -1;
+        if (inOrder.empty()) {
+          freeBuffers.pop(id);
+        } else if (!freeBuffers.tryPop(id)) {
+          break;
+        }
+        backend.submit(id, buffers[id].memory + CARRY_SIZE, STREAM_BUFFER_SIZE, nextOffset);
+        inOrder.push_back(id);
+        nextOffset += STREAM_BUFFER_SIZE;
+      }
+      if (inOrder.empty()) {
+        return true;
+      }
+
+      int id = inOrder.front();
+      inOrder.pop_front();
+      ssize_t bytesRead = waitFor(id);
+      if (bytesRead < 0) {
+        std::cerr << "Error reading input: " << strerror(-bytesRead) << std::endl;
+        drain(inOrder);
+        return false;
+      }
+      endOfInput = endOfInput || (size_t) bytesRead < STREAM_BUFFER_SIZE;
+
+      Buffer& buffer = buffers[id];
+      buffer.rowsStart = CARRY_SIZE - carry.size();
+      buffer.rowsEnd = CARRY_SIZE + bytesRead;
+      memcpy(buffer.memory + buffer.rowsStart, carry.data(), carry.size());
+      carry.clear();
+
+      bool lastBuffer = inOrder.empty() && (endOfInput || nextOffset >= fileSize);
+      if (!lastBuffer) {
+        size_t lastRowEnd = findLastRowEnd(buffer.memory, buffer.rowsStart, buffer.rowsEnd);
+        size_t carryStart = lastRowEnd == buffer.rowsEnd ? buffer.rowsStart : lastRowEnd + 1;
+        if (buffer.rowsEnd - carryStart > CARRY_SIZE) {
+          std::cerr << "Row longer than " << CARRY_SIZE << " bytes" << std::endl;
+          drain(inOrder);
+          return false;
+        }
+        carry.assign(buffer.memory + carryStart, buffer.rowsEnd - carryStart);
+        buffer.rowsEnd = carryStart;
+      }
+
+      if (buffer.rowsStart < buffer.rowsEnd) {
+        readyBuffers.push(id);
+      } else {
+        freeBuffers.push(id);
+      }
+    }
+  }
+
+  /**
+   * Waits until read id has finished, remembering reads that finish before it.
+  */
+  ssize_t waitFor(int id) {
+    while (!finished[id]) {
+      int doneId;
+      ssize_t result;
+      backend.wait(doneId, result);
+      results[doneId] = result;
+      finished[doneId] = true;
+    }
+    finished[id] = false;
+    return results[id];
+  }
+
+  void drain(std::deque<int>& inOrder) {
+    for (int id: inOrder) {
+      waitFor(id);
+    }
+    inOrder.clear();
+  }
+
+  ReadBackend& backend;
+  size_t fileSize;
+  std::vector<Buffer> buffers;
+  std::vector<ssize_t> results;
+  std::vector<bool> finished;
+  BlockingQueue<int> readyBuffers;
+  BlockingQueue<int> freeBuffers;
+};
+
+/**
+ * Parse the input through the streaming reader. Regular files use the backend
+ * chosen by READER, falling back to buffered I/O when O_DIRECT is not
+ * supported and to pread when io_uring is not available. Anything that
+ * cannot seek, like stdin or a pipe, is read sequentially until end of input.
+*/
+bool handleStreamedFile(
+    int fd,
+    bool seekable,
+    size_t fileSize,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations
+) {
+  if (!seekable) {
+    int bufferCount = THREADS_COUNT + 4;
+    SequentialReadBackend backend(fd);
+    return StreamingReader(backend, SIZE_MAX, bufferCount).run(pool, threadStations);
+  }
+
+  int readFd = fd;
+  if (DIRECT_IO) {
+    readFd = open(inputFileName.c_str(), O_RDONLY | O_DIRECT);
+    if (readFd == -1) {
+      std::cerr << "O_DIRECT not supported, using buffered reads" << std::endl;
+      readFd = fd;
+    }
+  }
+
+  int bufferCount = THREADS_COUNT + 4;
+  std::unique_ptr<ReadBackend> backend;
+#ifdef HAVE_IO_URING
+  if (READER == "uring") {
+    auto uring = std::make_unique<UringBackend>(readFd, fileSize);
+    if (uring->init(bufferCount)) {
+      backend = std::move(uring);
+    } else {
+      std::cerr << "io_uring not available, using pread" << std::endl;
+    }
+  }
+#endif
+  if (backend == nullptr) {
+    backend = std::make_unique<PreadBackend>(readFd);
+  }
+
+  bool ok = StreamingReader(*backend, fileSize, bufferCount).run(pool, threadStations);
+  backend.reset();
+  if (readFd != fd) {
+    close(readFd);
+  }
+  return ok;
+}
+
+/**
+ * Merge the per-thread tables on the pool without locks. First every worker
+ * splits its own table's entries into one bucket per shard, then every worker
+ * merges whole shards, taking that shard's bucket from each thread table.
+ * Shard tables borrow names from the thread tables, so threadStations must
+ * outlive the result.
+*/
+MergedStations mergeThreadStations(WorkerPool& pool, std::vector<Stations>& threadStations) {
+  size_t shardCount = pool.size();
+  size_t tableCount = threadStations.size();
+
+  std::vector<std::vector<std::vector<const Stations::Entry*>>> buckets(tableCount);
+  size_t largestTable = 0;
+  for (Stations& st: threadStations) {
+    largestTable = std::max(largestTable, st.size());
+  }
+
+  pool.run([&](int workerId) {
+    STATS(uint64_t startTicks = readTicks();)
+    for (size_t t = workerId; t < tableCount; t += pool.size()) {
+      buckets[t].resize(shardCount);
+      for (auto& entry: threadStations[t]) {
+        buckets[t][shardOf(entry.hash, shardCount)].push_back(&entry);
+      }
+    }
+    STATS(workerStats->mergeTicks += readTicks() - startTicks;)
+  });
+
+  size_t shardCapacity = 16;
+  while (shardCapacity < 2 * (largestTable / shardCount + 16)) {
+    shardCapacity *= 2;
+  }
+
+  MergedStations shards;
+  shards.reserve(shardCount);
+  for (size_t s = 0; s < shardCount; ++s) {
+    shards.emplace_back(shardCapacity);
+  }
+
+  pool.run([&](int workerId) {
+    STATS(uint64_t startTicks = readTicks();)
+    for (size_t s = workerId; s < shardCount; s += pool.size()) {
+      for (size_t t = 0; t < tableCount; ++t) {
+        for (const Stations::Entry* entry: buckets[t][s]) {
+          shards[s].mergeBorrowed(threadStations[t], *entry);
+        }
+      }
+    }
+    STATS(workerStats->mergeTicks += readTicks() - startTicks;)
+  });
+  return shards;
+}
+
+/**
+ * Pre-encoded columnar input. The file starts with an EncodedHeader and
+ * holds blocks of rows, each a column of u16 station ids followed by a column
+ * of i16 temperatures scaled by the header's decimals. The block index and the dictionary of
+ * station names (u16 length + bytes, in id order) follow the blocks, because
+ * the converter only knows them once every block is written; the header
+ * records where they start and is written last.
+*/
+constexpr char ENCODED_MAGIC[8] = {'1', 'B', 'R', 'C', 'C', 'O', 'L', '\0'};
+constexpr uint32_t ENCODED_VERSION = 1;
+constexpr size_t ENCODED_MAX_STATIONS = 1 << 16;
+constexpr size_t ENCODED_BLOCK_ALIGNMENT = 64;
+
+struct EncodedHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t decimals;
+  uint64_t rowCount;
+  uint64_t blockCount;
+  uint64_t blockIndexOffset;
+  uint64_t dictionaryOffset;
+  uint64_t dictionarySize;
+  uint32_t stationCount;
+  uint32_t reserved;
+};
+
+struct EncodedBlock {
+  uint64_t offset;
+  uint32_t rowCount;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(EncodedHeader) == 64, "EncodedHeader should stay 64 bytes");
+static_assert(sizeof(EncodedBlock) == 16, "EncodedBlock should stay 16 bytes");
+
+/**
+ * Open-addressing map from station name to its encoded id. The shared
+ * dictionary owns one with copied names; each converter worker keeps another
+ * as a private cache that borrows the dictionary's name bytes.
+*/
+class IdTable {
+public:
+  static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+  IdTable(): slots(1024), mask(1023) {}
+
+  uint32_t find(const char* name, size_t length, uint32_t hash) const {
+    for (size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+      const Entry& entry = slots[idx];
+      if (entry.name == nullptr) {
+        return NOT_FOUND;
+      }
+      if (entry.hash == hash
+          && entry.nameLength == length
+          && memcmp(entry.name, name, length) == 0) {
+        return entry.id;
+      }
+    }
+  }
+
+  /**
+   * Adds a name that is not in the table yet and returns its stored bytes.
+  */
+  const char* insert(const char* name, size_t length, uint32_t hash, uint32_t id, bool copyName) {
+    if ((count + 1) * 2 > slots.size()) {
+      grow();
+    }
+    size_t idx = hash & mask;
+    while (slots[idx].name != nullptr) {
+      idx = (idx + 1) & mask;
+    }
+    Entry& entry = slots[idx];
+    entry.name = copyName ? names.copy(name, length) : name;
+    entry.nameLength = length;
+    entry.hash = hash;
+    entry.id = id;
+    ++count;
+    return entry.name;
+  }
+
+private:
+  struct Entry {
+    const char* name = nullptr;
+    uint32_t nameLength = 0;
+    uint32_t hash = 0;
+    uint32_t id = 0;
+  };
+
+  void grow() {
+    std::vector<Entry> oldSlots(slots.size() * 2);
+    oldSlots.swap(slots);
+    mask = slots.size() - 1;
+    for (const Entry& entry: oldSlots) {
+      if (entry.name == nullptr) {
+        continue;
+      }
+      size_t idx = entry.hash & mask;
+      while (slots[idx].name != nullptr) {
+        idx = (idx + 1) & mask;
+      }
+      slots[idx] = entry;
+    }
+  }
+
+  std::vector<Entry> slots;
+  size_t mask;
+  size_t count = 0;
+  Arena names;
+};
+
+/**
+ * The global name to id dictionary built by the converter. Workers only come
+ * here on a miss in their own cache, so the mutex is taken about once per
+ * station per worker.
+*/
+class StationDictionary {
+public:
+  /**
+   * Returns the id of the name, assigning the next one to a new name, or
+   * NOT_FOUND if the name cannot be encoded.
+  */
+  uint32_t idOf(const char* name, size_t length, uint32_t hash, const char*& storedName) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t id = ids.find(name, length, hash);
+    if (id == IdTable::NOT_FOUND) {
+      if (names.size() == ENCODED_MAX_STATIONS || length > UINT16_MAX) {
+        return IdTable::NOT_FOUND;
+      }
+      id = names.size();
+      names.emplace_back(ids.insert(name, length, hash, id, true), length);
+    }
+    storedName = names[id].data();
+    return id;
+  }
+
+  const std::vector<std::string_view>& all() const {
+    return names;
+  }
+
+private:
+  std::mutex mutex;
+  IdTable ids;
+  std::vector<std::string_view> names;
+};
+
+/**
+ * Writes encoded blocks at offsets reserved with one atomic add, so workers
+ * never wait for each other; only the block index append takes a lock.
+*/
+class EncodedWriter {
+public:
+  explicit EncodedWriter(int fd): fd(fd) {}
+
+  bool writeBlock(const std::vector<uint16_t>& ids, const std::vector<int16_t>& temps) {
+    size_t rows = ids.size();
+    size_t size = rows * (sizeof(uint16_t) + sizeof(int16_t));
+    size_t reserved = (size + ENCODED_BLOCK_ALIGNMENT - 1) & ~(ENCODED_BLOCK_ALIGNMENT - 1);
+    uint64_t offset = nextOffset.fetch_add(reserved);
+
+    if (!pwriteAll(fd, (const char*) ids.data(), rows * sizeof(uint16_t), offset)
+        || !pwriteAll(fd, (const char*) temps.data(), rows * sizeof(int16_t),
+                      offset + rows * sizeof(uint16_t))) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.push_back(EncodedBlock{offset, (uint32_t) rows, 0});
+    rowCount += rows;
+    return true;
+  }
+
+  /**
+   * Appends the block index and dictionary, then writes the header.
+  */
+  bool finish(const StationDictionary& dictionary) {
+    std::sort(blocks.begin(), blocks.end(), [](const auto& a, const auto& b) {
+      return a.offset < b.offset;
+    });
+
+    std::string dictionaryBytes;
+    for (std::string_view name: dictionary.all()) {
+      uint16_t length = name.size();
+      dictionaryBytes.append((const char*) &length, sizeof(length));
+      dictionaryBytes.append(name);
+    }
+
+    EncodedHeader header = {};
+    memcpy(header.magic, ENCODED_MAGIC, sizeof(header.magic));
+    header.version = ENCODED_VERSION;
+    header.decimals = INPUT_DECIMALS;
+    header.rowCount = rowCount;
+    header.blockCount = blocks.size();
+    header.blockIndexOffset = nextOffset.load();
+    header.dictionaryOffset = header.blockIndexOffset + blocks.size() * sizeof(EncodedBlock);
+    header.dictionarySize = dictionaryBytes.size();
+    header.stationCount = dictionary.all().size();
+
+    return pwriteAll(fd, (const char*) blocks.data(), blocks.size() * sizeof(EncodedBlock),
+                     header.blockIndexOffset)
+      && pwriteAll(fd, dictionaryBytes.data(), dictionaryBytes.size(), header.dictionaryOffset)
+      && ftruncate(fd, header.dictionaryOffset + header.dictionarySize) == 0
+      && pwriteAll(fd, (const char*) &header, sizeof(header), 0);
+  }
+
+private:
+  int fd;
+  std::atomic<uint64_t> nextOffset{sizeof(EncodedHeader)};
+  std::mutex mutex;
+  std::vector<EncodedBlock> blocks;
+  uint64_t rowCount = 0;
+};
+
+/**
+ * Like handleChunkAs, but appends each row's station id and value to the
+ * columns instead of aggregating. Returns false if a station cannot be
+ * encoded.
+*/
+template <typename Format>
+bool encodeChunk(
+    const char* data,
+    size_t startIdx,
+    size_t endIdx,
+    IdTable& cache,
+    StationDictionary& dictionary,
+    std::vector<uint16_t>& ids,
+    std::vector<int16_t>& temps)
+{
+  size_t ptr = startIdx;
+  DelimiterScanner<Format::DELIMITER> scanner(data, startIdx, endIdx);
+  STATS(++workerStats->chunks; workerStats->bytes += endIdx - startIdx;)
+
+  while (ptr < endIdx) {
+    STATS(++workerStats->rows;)
+    size_t rowStart = ptr;
+    const char *nameStart = data + ptr;
+    ptr = scanner.nextDelimiter(ptr);
+    size_t nameLength = data + ptr - nameStart;
+
+    if constexpr (Format::STRICT) {
+      if (!isValidRow<Format>(data, rowStart, ptr, endIdx)) {
+        ptr = reportMalformedRow(data, rowStart, endIdx);
+        continue;
+      }
+    }
+
+    ++ptr; // consume the delimiter
+    int temperature10 = -1000;
+    ptr = parseValue<Format>(data, ptr, endIdx, temperature10);
+
+    uint32_t hash = hashName(nameStart, nameLength);
+    if constexpr (Format::FILTER) {
+      if (!ROW_FILTER.acceptsValue(temperature10)
+          || !ROW_FILTER.acceptsName(nameStart, nameLength, hash)) {
+        continue;
+      }
+    }
+    uint32_t id = cache.find(nameStart, nameLength, hash);
+    if (id == IdTable::NOT_FOUND) {
+      const char* storedName;
+      id = dictionary.idOf(nameStart, nameLength, hash, storedName);
+      if (id == IdTable::NOT_FOUND) {
+        return false;
+      }
+      cache.insert(storedName, nameLength, hash, id, false);
+    }
+    ids.push_back(id);
+    temps.push_back(temperature10);
+  }
+  return true;
+}
+
+/**
+ * Converts a text file to the encoded format in one parallel pass: every
+ * chunk becomes one block.
+*/
+bool convertFile(const char* fileData, size_t fileSize, WorkerPool& pool, const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    std::cerr << "Error opening output file: " << path << std::endl;
+    return false;
+  }
+
+  StationDictionary dictionary;
+  EncodedWriter writer(fd);
+  ChunkCursor chunks(fileData, 0, fileSize);
+  std::atomic<bool> ok{true};
+  std::atomic<bool> tooManyStations{false};
+  auto encodeChunkAs = withRowFormat([](auto format) {
+    return encodeChunk<decltype(format)>;
+  });
+
+  pool.run([&](int) {
+    IdTable cache;
+    std::vector<uint16_t> ids;
+    std::vector<int16_t> temps;
+    size_t chunkStart, chunkEnd;
+    while (ok && chunks.next(chunkStart, chunkEnd)) {
+      ids.clear();
+      temps.clear();
+      if (!encodeChunkAs(fileData, chunkStart, chunkEnd, cache, dictionary, ids, temps)) {
+        tooManyStations = true;
+        ok = false;
+      } else if (!writer.writeBlock(ids, temps)) {
+        ok = false;
+      }
+    }
+  });
+
+  if (MALFORMED_INPUT) {
+    ok = false;
+  } else if (tooManyStations) {
+    std::cerr << "Input has more than " << ENCODED_MAX_STATIONS
+      << " stations or a name too long to encode" << std::endl;
+  } else if (!ok || !writer.finish(dictionary)) {
+    std::cerr << "Error writing " << path << std::endl;
+    ok = false;
+  }
+  close(fd);
+  if (!ok) {
+    unlink(path.c_str());
+  }
+  return ok;
+}
+
+bool isEncodedFile(int fd, size_t fileSize) {
+  char magic[sizeof(ENCODED_MAGIC)];
+  return fileSize >= sizeof(EncodedHeader)
+    && pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+    && memcmp(magic, ENCODED_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Aggregates one block into dense per-id accumulators. Each id owns four
+ * interleaved Station lanes and consecutive rows go to different lanes, so
+ * runs of one station do not serialize on a single accumulator. There is no
+ * scatter instruction on AVX2 and conflicting ids would need resolving
+ * anyway; the interleaved lanes give the same independence with scalar
+ * stores.
+*/
+inline void aggregateBlock(const uint16_t* ids, const int16_t* temps, size_t rows, Station* lanes) {
+  size_t i = 0;
+  for (; i + 4 <= rows; i += 4) {
+    lanes[ids[i] * 4 + 0].addMeasurement(temps[i]);
+    lanes[ids[i + 1] * 4 + 1].addMeasurement(temps[i + 1]);
+    lanes[ids[i + 2] * 4 + 2].addMeasurement(temps[i + 2]);
+    lanes[ids[i + 3] * 4 + 3].addMeasurement(temps[i + 3]);
+  }
+  for (; i < rows; ++i) {
+    lanes[ids[i] * 4 + (i & 3)].addMeasurement(temps[i]);
+  }
+}
+
+/**
+ * Aggregates a mapped encoded file on the pool into a single shard. Returns
+ * false if the file is malformed.
+*/
+bool handleEncodedFile(const char* fileData, size_t fileSize, WorkerPool& pool, MergedStations& merged) {
+  EncodedHeader header;
+  memcpy(&header, fileData, sizeof(header));
+  auto fits = [&](uint64_t offset, uint64_t size) {
+    return offset <= fileSize && size <= fileSize - offset;
+  };
+  if (header.version != ENCODED_VERSION || header.decimals < 1 || header.decimals > 2
+      || header.stationCount > ENCODED_MAX_STATIONS
+      || header.blockCount > fileSize / sizeof(EncodedBlock)
+      || !fits(header.blockIndexOffset, header.blockCount * sizeof(EncodedBlock))
+      || !fits(header.dictionaryOffset, header.dictionarySize)) {
+    std::cerr << "Unsupported or corrupt encoded file" << std::endl;
+    return false;
+  }
+  INPUT_DECIMALS = header.decimals;
+
+  std::vector<EncodedBlock> blocks(header.blockCount);
+  memcpy(blocks.data(), fileData + header.blockIndexOffset, blocks.size() * sizeof(EncodedBlock));
+  for (const EncodedBlock& block: blocks) {
+    if (!fits(block.offset, (uint64_t) block.rowCount * (sizeof(uint16_t) + sizeof(int16_t)))
+        || block.offset % alignof(uint16_t) != 0) {
+      std::cerr << "Corrupt encoded block index" << std::endl;
+      return false;
+    }
+  }
+
+  size_t stationCount = header.stationCount;
+  std::vector<std::vector<Station>> workerLanes(pool.size());
+  std::atomic<size_t> nextBlock{0};
+  std::atomic<bool> badId{false};
+
+  pool.run([&](int workerId) {
+    std::vector<Station>& lanes = workerLanes[workerId];
+    lanes.resize(stationCount * 4);
+    for (size_t b = nextBlock++; b < blocks.size(); b = nextBlock++) {
+      const EncodedBlock& block = blocks[b];
+      const uint16_t* ids = (const uint16_t*) (fileData + block.offset);
+      const int16_t* temps = (const int16_t*) (ids + block.rowCount);
+      STATS(++workerStats->chunks; workerStats->rows += block.rowCount;)
+      STATS(workerStats->bytes += block.rowCount * (sizeof(uint16_t) + sizeof(int16_t));)
+
+      uint16_t maxId = 0;
+      for (size_t i = 0; i < block.rowCount; ++i) {
+        maxId = std::max(maxId, ids[i]);
+      }
+      if (block.rowCount > 0 && maxId >= stationCount) {
+        badId = true;
+        return;
+      }
+      aggregateBlock(ids, temps, block.rowCount, lanes.data());
+    }
+  });
+  if (badId) {
+    std::cerr << "Corrupt encoded block: station id out of range" << std::endl;
+    return false;
+  }
+
+  std::vector<Station> totals(stationCount);
+  pool.run([&](int workerId) {
+    for (size_t id = workerId; id < stationCount; id += pool.size()) {
+      for (const auto& lanes: workerLanes) {
+        for (size_t lane = 0; lane < 4; ++lane) {
+          totals[id].merge(lanes[id * 4 + lane]);
+        }
+      }
+    }
+  });
+
+  merged.clear();
+  merged.emplace_back();
+  const char* dictionary = fileData + header.dictionaryOffset;
+  size_t ptr = 0;
+  for (size_t id = 0; id < stationCount; ++id) {
+    uint16_t length;
+    if (ptr + sizeof(length) > header.dictionarySize) {
+      std::cerr << "Corrupt encoded dictionary" << std::endl;
+      return false;
+    }
+    memcpy(&length, dictionary + ptr, sizeof(length));
+    ptr += sizeof(length);
+    if (ptr + length > header.dictionarySize) {
+      std::cerr << "Corrupt encoded dictionary" << std::endl;
+      return false;
+    }
+    if (totals[id].measurementCount > 0) {
+      merged[0].findOrInsert(dictionary + ptr, length).merge(totals[id]);
+    }
+    ptr += length;
+  }
+  return true;
+}
+
+/**
+ * Saved aggregate of an append-only input (--checkpoint). The file stores
+ * the input's identity, the offset just past the last complete row that was
+ * aggregated, hashes of the bytes before that offset, and every station's
+ * state. A run that finds a matching checkpoint only parses the bytes
+ * appended since.
+*/
+constexpr char CHECKPOINT_MAGIC[8] = {'1', 'B', 'R', 'C', 'C', 'K', 'P', '\0'};
+constexpr uint32_t CHECKPOINT_VERSION = 2;
+// Bytes hashed at the start of the input and just before the offset.
+constexpr size_t CHECKPOINT_FINGERPRINT_SIZE = 4096;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t stationCount;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t offset;
+  uint32_t headHash;
+  uint32_t tailHash;
+  char delimiter;
+  uint8_t decimals;
+  uint8_t reserved[6];
+};
+
+static_assert(sizeof(CheckpointHeader) == 56, "CheckpointHeader should stay 56 bytes");
+
+struct Checkpoint {
+  size_t offset = 0;
+  uint32_t headHash = 0;
+  uint32_t tailHash = 0;
+  Stations stations;
+
+  /**
+   * Sets offset and hashes the input bytes that identify data[0, offset).
+  */
+  void fingerprint(const char* data, size_t newOffset) {
+    offset = newOffset;
+    headHash = hashName(data, std::min(offset, CHECKPOINT_FINGERPRINT_SIZE));
+    size_t tailSize = std::min(offset, CHECKPOINT_FINGERPRINT_SIZE);
+    tailHash = hashName(data + offset - tailSize, tailSize);
+  }
+};
+
+/**
+ * Loads the checkpoint at path into checkpoint if it was taken from this
+ * input with the same delimiter and decimals, and the input still starts with
+ * the same bytes. Otherwise leaves it empty, so the whole input is aggregated
+ * again.
+*/
+void loadCheckpoint(
+    const std::string& path,
+    const struct stat& input,
+    const char* fileData,
+    size_t fileSize,
+    Checkpoint& checkpoint)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return;
+  }
+
+  CheckpointHeader header;
+  if (!in.read((char*) &header, sizeof(header))
+      || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0
+      || header.version != CHECKPOINT_VERSION) {
+    std::cerr << "Ignoring unreadable checkpoint " << path << std::endl;
+    return;
+  }
+
+  Checkpoint current;
+  if (header.offset <= fileSize) {
+    current.fingerprint(fileData, header.offset);
+  }
+  if (header.device != (uint64_t) input.st_dev
+      || header.inode != (uint64_t) input.st_ino
+      || header.offset > fileSize
+      || header.headHash != current.headHash
+      || header.tailHash != current.tailHash
+      || header.delimiter != INPUT_DELIMITER
+      || header.decimals != INPUT_DECIMALS) {
+    std::cerr << "Checkpoint " << path << " does not match the input or format, starting over"
+      << std::endl;
+    return;
+  }
+
+  Stations stations;
+  std::string name;
+  for (uint32_t i = 0; i < header.stationCount; ++i) {
+    Station station;
+    uint16_t length;
+    if (!in.read((char*) &station, sizeof(station)) || !in.read((char*) &length, sizeof(length))) {
+      std::cerr << "Ignoring truncated checkpoint " << path << std::endl;
+      return;
+    }
+    name.resize(length);
+    if (!in.read(name.data(), length)) {
+      std::cerr << "Ignoring truncated checkpoint " << path << std::endl;
+      return;
+    }
+    stations.findOrInsert(name.data(), length).merge(station);
+  }
+
+  checkpoint.offset = header.offset;
+  checkpoint.headHash = header.headHash;
+  checkpoint.tailHash = header.tailHash;
+  checkpoint.stations = std::move(stations);
+}
+
+/**
+ * Adds the stations of one table to the merged shards. The shards borrow the
+ * names, so stations must outlive them.
+*/
+void mergeIntoShards(Stations& stations, MergedStations& merged) {
+  for (auto& entry: stations) {
+    merged[shardOf(entry.hash, merged.size())].mergeBorrowed(stations, entry);
+  }
+}
+
+/**
+ * Appends the record of one entry as checkpoints and indexes store it: the
+ * Station, the name length as u16 and the name.
+*/
+bool appendStationRecord(std::string& out, const Stations::Entry& entry) {
+  if (entry.nameLength > UINT16_MAX) {
+    std::cerr << "Station name too long to store" << std::endl;
+    return false;
+  }
+  uint16_t length = entry.nameLength;
+  out.append((const char*) &entry.station, sizeof(entry.station));
+  out.append((const char*) &length, sizeof(length));
+  out.append(entry.name, length);
+  return true;
+}
+
+/**
+ * Writes the merged state as the checkpoint for input up to checkpoint.offset.
+ * The file is written next to path and renamed over it, so a crash never
+ * leaves a partial checkpoint behind.
+*/
+bool saveCheckpoint(
+    const std::string& path,
+    const struct stat& input,
+    const Checkpoint& checkpoint,
+    MergedStations& merged)
+{
+  CheckpointHeader header = {};
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.device = input.st_dev;
+  header.inode = input.st_ino;
+  header.offset = checkpoint.offset;
+  header.headHash = checkpoint.headHash;
+  header.tailHash = checkpoint.tailHash;
+  header.delimiter = INPUT_DELIMITER;
+  header.decimals = INPUT_DECIMALS;
+
+  std::string contents((const char*) &header, sizeof(header));
+  uint32_t stationCount = 0;
+  for (Stations& shard: merged) {
+    for (const auto& entry: shard) {
+      if (!appendStationRecord(contents, entry)) {
+        return false;
+      }
+      ++stationCount;
+    }
+  }
+  memcpy(contents.data() + offsetof(CheckpointHeader, stationCount), &stationCount, sizeof(stationCount));
+
+  std::string tmpPath = path + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    std::cerr << "Error opening checkpoint file: " << tmpPath << std::endl;
+    return false;
+  }
+  bool ok = writeAll(fd, contents.data(), contents.size()) && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::cerr << "Error writing checkpoint file: " << path << std::endl;
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Sidecar index of a static text input (--index): the aggregates of every
+ * row-aligned chunk of INDEX_CHUNK_SIZE bytes, written during the normal
+ * parallel pass. A --range query then merges the chunks it fully covers from
+ * the index and only parses the partial chunks at its two edges.
+ *
+ * The file starts with an IndexHeader, followed by the station records of
+ * each chunk (Station, u16 name length, name) in the order workers finished
+ * them, and ends with the IndexChunk table sorted by chunk start. The header
+ * identifies the input and the options that change the keys or values.
+*/
+constexpr char INDEX_MAGIC[8] = {'1', 'B', 'R', 'C', 'I', 'D', 'X', '\0'};
+constexpr uint32_t INDEX_VERSION = 1;
+constexpr size_t INDEX_CHUNK_SIZE = 1024 * 1024 * 16;
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunkCount;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t fileSize;
+  uint64_t chunkSize;
+  uint64_t chunkTableOffset;
+  int64_t timeBucketSeconds;
+  uint32_t headHash;
+  uint32_t tailHash;
+  char delimiter;
+  uint8_t decimals;
+  uint8_t reserved[6];
+};
+
+static_assert(sizeof(IndexHeader) == 80, "IndexHeader should stay 80 bytes");
+
+struct IndexChunk {
+  uint64_t start;
+  uint64_t end;
+  uint64_t dataOffset;
+  uint32_t dataSize;
+  uint32_t stationCount;
+};
+
+static_assert(sizeof(IndexChunk) == 32, "IndexChunk should stay 32 bytes");
+
+/**
+ * Fills in what identifies the input and the aggregation options.
+*/
+IndexHeader makeIndexHeader(const struct stat& input, const char* fileData, size_t fileSize) {
+  IndexHeader header = {};
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.device = input.st_dev;
+  header.inode = input.st_ino;
+  header.fileSize = fileSize;
+  header.chunkSize = INDEX_CHUNK_SIZE;
+  header.timeBucketSeconds = TIME_BUCKET_SECONDS;
+  size_t fingerprintSize = std::min(fileSize, CHECKPOINT_FINGERPRINT_SIZE);
+  header.headHash = hashName(fileData, fingerprintSize);
+  header.tailHash = hashName(fileData + fileSize - fingerprintSize, fingerprintSize);
+  header.delimiter = INPUT_DELIMITER;
+  header.decimals = INPUT_DECIMALS;
+  return header;
+}
+
+/**
+ * Writes the index next to its path while the pass runs and renames it into
+ * place once complete.
+*/
+class IndexWriter {
+public:
+  explicit IndexWriter(const std::string& path): path(path), tmpPath(path + ".tmp") {}
+
+  ~IndexWriter() {
+    if (fd != -1) {
+      close(fd);
+      unlink(tmpPath.c_str());
+    }
+  }
+
+  bool open() {
+    fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      std::cerr << "Error opening index file: " << tmpPath << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Stores the aggregates of the rows in [start, end). Called concurrently
+   * by the workers.
+  */
+  bool addChunk(size_t start, size_t end, Stations& stations) {
+    std::string records;
+    for (const auto& entry: stations) {
+      if (!appendStationRecord(records, entry)) {
+        return false;
+      }
+    }
+    uint64_t offset = nextOffset.fetch_add(records.size());
+    if (!pwriteAll(fd, records.data(), records.size(), offset)) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    chunks.push_back(IndexChunk{start, end, offset, (uint32_t) records.size(),
+                                (uint32_t) stations.size()});
+    return true;
+  }
+
+  /**
+   * Appends the chunk table, writes the header and renames the index into
+   * place.
+  */
+  bool finish(IndexHeader header) {
+    std::sort(chunks.begin(), chunks.end(), [](const auto& a, const auto& b) {
+      return a.start < b.start;
+    });
+    header.chunkCount = chunks.size();
+    header.chunkTableOffset = nextOffset.load();
+
+    bool ok = pwriteAll(fd, (const char*) chunks.data(), chunks.size() * sizeof(IndexChunk),
+                        header.chunkTableOffset)
+      && pwriteAll(fd, (const char*) &header, sizeof(header), 0)
+      && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+      std::cerr << "Error writing index file: " << path << std::endl;
+      unlink(tmpPath.c_str());
+      return false;
+    }
+    return true;
+  }
+
+private:
+  std::string path;
+  std::string tmpPath;
+  int fd = -1;
+  std::atomic<uint64_t> nextOffset{sizeof(IndexHeader)};
+  std::mutex mutex;
+  std::vector<IndexChunk> chunks;
+};
+
+/**
+ * Aggregates the whole mapped file into threadStations like handleMappedFile,
+ * in chunks of INDEX_CHUNK_SIZE whose aggregates also go to writer. Each
+ * chunk is parsed into a table of its own, which is then merged into the
+ * worker's table.
+*/
+bool buildIndex(
+    const char* fileData,
+    size_t fileSize,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations,
+    IndexWriter& writer)
+{
+  ChunkCursor chunks(fileData, 0, fileSize, INDEX_CHUNK_SIZE);
+  std::atomic<bool> ok{true};
+  pool.run([&](int workerId) {
+    size_t chunkStart, chunkEnd;
+    while (ok && chunks.next(chunkStart, chunkEnd)) {
+      Stations chunkStations(1024);
+      handleChunk(fileData, chunkStart, chunkEnd, chunkStations);
+      if (!writer.addChunk(chunkStart, chunkEnd, chunkStations)) {
+        ok = false;
+      }
+      for (const auto& entry: chunkStations) {
+        threadStations[workerId].findOrInsert(entry.name, entry.nameLength, entry.hash)
+          .merge(entry.station);
+      }
+    }
+  });
+  return ok && !MALFORMED_INPUT;
+}
+
+/**
+ * An index opened for queries: its header and chunk table.
 */
-class Station {
-public:
-  int minTemp = 9999999;
-  int maxTemp = -9999999;
-  int totalTemp = 0;
-  int measurementCount = 0;
+class IndexReader {
 public:
-  void addMeasurement(int temp) {
-    totalTemp += temp;
-    ++measurementCount;
+  ~IndexReader() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  /**
+   * Opens the index at path if it was built from this input with the same
+   * options. Returns false, quietly if there is no index yet, otherwise.
+  */
+  bool open(const std::string& path, const struct stat& input, const char* fileData, size_t fileSize) {
+    if (fd != -1) {
+      close(fd);
+    }
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+
+    IndexHeader header;
+    IndexHeader expected = makeIndexHeader(input, fileData, fileSize);
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+        || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0
+        || header.version != INDEX_VERSION) {
+      std::cerr << "Ignoring unreadable index " << path << std::endl;
+      return false;
+    }
+    if (header.device != expected.device
+        || header.inode != expected.inode
+        || header.fileSize != expected.fileSize
+        || header.chunkSize != expected.chunkSize
+        || header.headHash != expected.headHash
+        || header.tailHash != expected.tailHash
+        || header.delimiter != expected.delimiter
+        || header.decimals != expected.decimals
+        || header.timeBucketSeconds != expected.timeBucketSeconds) {
+      std::cerr << "Index " << path << " does not match the input or options, rebuilding it"
+        << std::endl;
+      return false;
+    }
 
-    if (measurementCount == 1) {
-      minTemp = maxTemp = temp;
+    if (header.chunkCount > header.fileSize / header.chunkSize + 1) {
+      std::cerr << "Ignoring corrupt index " << path << std::endl;
+      return false;
+    }
+    chunks.resize(header.chunkCount);
+    size_t tableSize = chunks.size() * sizeof(IndexChunk);
+    if (pread(fd, chunks.data(), tableSize, header.chunkTableOffset) != (ssize_t) tableSize) {
+      std::cerr << "Ignoring truncated index " << path << std::endl;
+      return false;
     }
 
-    if (temp < minTemp) minTemp = temp;
-    if (temp > maxTemp) maxTemp = temp;
+    // Chunks must be ordered, inside the input, and keep their records
+    // between the header and the chunk table.
+    uint64_t previousEnd = 0;
+    for (const IndexChunk& chunk: chunks) {
+      if (chunk.start < previousEnd || chunk.end < chunk.start || chunk.end > fileSize
+          || chunk.dataOffset < sizeof(IndexHeader)
+          || chunk.dataOffset + chunk.dataSize > header.chunkTableOffset) {
+        std::cerr << "Ignoring corrupt index " << path << std::endl;
+        return false;
+      }
+      previousEnd = chunk.end;
+    }
+    return true;
   }
 
-  void merge(Station& other) {
-    totalTemp += other.totalTemp;
-    measurementCount += other.measurementCount;
+  /**
+   * The chunks that lie entirely within [begin, end), as [first, last).
+  */
+  std::pair<size_t, size_t> chunksWithin(size_t begin, size_t end) const {
+    auto first = std::lower_bound(chunks.begin(), chunks.end(), begin,
+      [](const IndexChunk& chunk, size_t offset) { return chunk.start < offset; });
+    auto last = std::upper_bound(first, chunks.end(), end,
+      [](size_t offset, const IndexChunk& chunk) { return offset < chunk.end; });
+    return {first - chunks.begin(), last - chunks.begin()};
+  }
 
-    minTemp = std::min(minTemp, other.minTemp);
-    maxTemp = std::max(maxTemp, other.maxTemp);
+  const IndexChunk& chunk(size_t i) const {
+    return chunks[i];
   }
 
-  float averageTemp() {
-    return (float) totalTemp / measurementCount;
+  /**
+   * Adds the aggregates of chunks [first, last) to stations. Returns false if
+   * the records cannot be read or do not fit their chunk; stations is then
+   * partially updated.
+  */
+  bool mergeChunks(size_t first, size_t last, Stations& stations) const {
+    std::string records;
+    for (size_t i = first; i < last; ++i) {
+      const IndexChunk& chunk = chunks[i];
+      records.resize(chunk.dataSize);
+      if (pread(fd, records.data(), chunk.dataSize, chunk.dataOffset) != (ssize_t) chunk.dataSize) {
+        std::cerr << "Error reading index" << std::endl;
+        return false;
+      }
+      size_t pos = 0;
+      for (uint32_t s = 0; s < chunk.stationCount; ++s) {
+        Station station;
+        uint16_t length;
+        if (records.size() - pos < sizeof(station) + sizeof(length)) {
+          return false;
+        }
+        memcpy(&station, records.data() + pos, sizeof(station));
+        memcpy(&length, records.data() + pos + sizeof(station), sizeof(length));
+        pos += sizeof(station) + sizeof(length);
+        if (records.size() - pos < length) {
+          return false;
+        }
+        stations.findOrInsert(records.data() + pos, length).merge(station);
+        pos += length;
+      }
+      if (pos != records.size()) {
+        return false;
+      }
+    }
+    return true;
   }
+
+private:
+  int fd = -1;
+  std::vector<IndexChunk> chunks;
 };
 
-using Stations = std::unordered_map<std::string, Station>;
+/**
+ * The first row start at or after idx in data[0, endIdx).
+*/
+size_t rowStartAtOrAfter(const char* data, size_t idx, size_t endIdx) {
+  if (idx == 0 || idx >= endIdx) {
+    return std::min(idx, endIdx);
+  }
+  return std::min(findFirstRowEnd(data, idx - 1, endIdx) + 1, endIdx);
+}
+
+/**
+ * Aggregates the rows that start within [RANGE_START, RANGE_END), all rows by
+ * default, using the index at INDEX_PATH if there is one. Without a matching
+ * index the whole file is parsed once to build it; that pass already is the
+ * answer for the whole file. Otherwise the chunks within the range are merged
+ * from the index into indexed and only the rows before the first and after
+ * the last of them are parsed into threadStations.
+*/
+bool handleRangeQuery(
+    const char* fileData,
+    size_t fileSize,
+    const struct stat& input,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations,
+    Stations& indexed)
+{
+  size_t rowsBegin = rowStartAtOrAfter(fileData, RANGE_START, fileSize);
+  size_t rowsEnd = rowStartAtOrAfter(fileData, RANGE_END, fileSize);
+  if (INDEX_PATH.empty()) {
+    handleMappedFile(fileData, rowsBegin, rowsEnd, pool, threadStations);
+    return true;
+  }
+
+  IndexReader index;
+  if (!index.open(INDEX_PATH, input, fileData, fileSize)) {
+    IndexWriter writer(INDEX_PATH);
+    if (!writer.open()
+        || !buildIndex(fileData, fileSize, pool, threadStations, writer)
+        || !writer.finish(makeIndexHeader(input, fileData, fileSize))) {
+      return false;
+    }
+    if (rowsBegin == 0 && rowsEnd == fileSize) {
+      return true;
+    }
+    for (Stations& stations: threadStations) {
+      stations = Stations();
+    }
+    if (!index.open(INDEX_PATH, input, fileData, fileSize)) {
+      return false;
+    }
+  }
 
-void output(Stations& stations) {
-  std::vector<std::string> names;
-  names.reserve(stations.size());
+  auto [first, last] = index.chunksWithin(rowsBegin, rowsEnd);
+  if (first != last && !index.mergeChunks(first, last, indexed)) {
+    std::cerr << "Index " << INDEX_PATH << " is corrupt, scanning the range instead" << std::endl;
+    indexed = Stations(16);
+    first = last;
+  }
+  if (first == last) {
+    handleMappedFile(fileData, rowsBegin, rowsEnd, pool, threadStations);
+    return true;
+  }
+  handleMappedFile(fileData, rowsBegin, index.chunk(first).start, pool, threadStations);
+  handleMappedFile(fileData, index.chunk(last - 1).end, rowsEnd, pool, threadStations);
+  return true;
+}
 
-  for (const auto& pair: stations) {
-    names.push_back(pair.first);
+/**
+ * Merges the per-thread tables; with --numa, per node first.
+*/
+MergedStations mergeWorkerStations(WorkerPool& pool, std::vector<Stations>& threadStations) {
+  if (!NUMA_AWARE) {
+    return mergeThreadStations(pool, threadStations);
   }
-  std::sort(names.begin(), names.end());
+  std::vector<Stations> nodeStations;
+  mergePerNode(pool, threadStations, nodeStations);
+  return mergeThreadStations(pool, nodeStations);
+}
 
-  std::cout << "{";
-  std::cout << std::fixed << std::setprecision(1);
+#ifdef ONEBRC_STATS
+/**
+ * Prints the collected statistics to stderr. Ticks are converted to seconds
+ * with a rate measured over the whole run.
+*/
+void printStats() {
+  double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - RUN_STATS.startTime).count();
+  double ticksPerSecond = (readTicks() - RUN_STATS.startTicks) / std::max(elapsed, 1e-9);
+  auto seconds = [&](uint64_t ticks) {
+    return ticks / ticksPerSecond;
+  };
 
-  for (int i = 0; i < names.size(); ++i) {
-    std::string& name = names[i];
-    Station& station = stations[name];
+  std::cerr << std::fixed;
+  std::cerr.precision(3);
+  std::cerr << "total " << elapsed << "s, map " << seconds(RUN_STATS.mapTicks)
+    << "s, parse " << seconds(RUN_STATS.parseTicks)
+    << "s, merge " << seconds(RUN_STATS.mergeTicks)
+    << "s, output " << seconds(RUN_STATS.outputTicks) << "s" << std::endl;
+  std::cerr << "worker chunks rows bytes scan_s hash_s merge_s idle_s"
+    << " lookups avg_probe max_probe collisions" << std::endl;
 
-    std::cout << name << "="
-      << (float)station.minTemp / 10 << "/"
-      << station.averageTemp() / 10 << "/"
-      << (float) station.maxTemp / 10;
-    if (i != names.size() - 1) {
-      std::cout << ", ";
-    }
+  WorkerStats total;
+  auto printRow = [&](const std::string& label, const WorkerStats& stats) {
+    std::cerr << label << " " << stats.chunks << " " << stats.rows << " " << stats.bytes
+      << " " << seconds(stats.scanTicks) << " " << seconds(stats.hashTicks)
+      << " " << seconds(stats.mergeTicks) << " " << seconds(stats.idleTicks)
+      << " " << stats.lookups << " " << (double) stats.probes / std::max<uint64_t>(stats.lookups, 1)
+      << " " << stats.maxProbeLength << " " << stats.collisions << std::endl;
+  };
+  for (size_t i = 0; i < WORKER_STATS.size(); ++i) {
+    const WorkerStats& stats = WORKER_STATS[i];
+    printRow(std::to_string(i), stats);
+    total.chunks += stats.chunks;
+    total.rows += stats.rows;
+    total.bytes += stats.bytes;
+    total.scanTicks += stats.scanTicks;
+    total.hashTicks += stats.hashTicks;
+    total.mergeTicks += stats.mergeTicks;
+    total.idleTicks += stats.idleTicks;
+    total.lookups += stats.lookups;
+    total.probes += stats.probes;
+    total.collisions += stats.collisions;
+    total.maxProbeLength = std::max(total.maxProbeLength, stats.maxProbeLength);
   }
+  printRow("all", total);
+}
+#endif
 
-  std::cout << "}" << std::endl;
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program
+    << " [--strict] [--threads N] [--reader mmap|pread|uring] [--direct]"
+    << " [--populate] [--sequential] [--hugepages] [--stats] [--convert out.bin]"
+    << " [--checkpoint path] [--numa] [--delimiter ;|,|'|'|tab] [--decimals 1|2]"
+    << " [--percentiles] [--station NAME]... [--prefix PREFIX]..."
+    << " [--min-temp T] [--max-temp T] [--time-bucket SECONDS] [--serve SOCKET]"
+    << " [--index path] [--range START:END]"
+    << " [input_file | directory | 'glob' | -]..."
+    << std::endl;
 }
 
-int fastS2I(const char *data, int startIndex, int& result) {
-  int temp10 = 0;
+bool parseArgs(int argc, char** argv) {
+  std::string minTemp, maxTemp;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--strict") {
+      STRICT_PARSING = true;
+    } else if (arg == "--threads" && i + 1 < argc) {
+      THREADS_COUNT = std::atoi(argv[++i]);
+      if (THREADS_COUNT < 1) {
+        std::cerr << "Invalid thread count: " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg == "--reader" && i + 1 < argc) {
+      READER = argv[++i];
+      if (READER != "mmap" && READER != "pread" && READER != "uring") {
+        std::cerr << "Unknown reader: " << READER << std::endl;
+        return false;
+      }
+    } else if (arg == "--direct") {
+      DIRECT_IO = true;
+    } else if (arg == "--stats") {
+      PRINT_STATS = true;
+    } else if (arg == "--populate") {
+      MAP_POPULATE_PAGES = true;
+    } else if (arg == "--sequential") {
+      MADVISE_SEQUENTIAL = true;
+    } else if (arg == "--hugepages") {
+      MADVISE_HUGEPAGE = true;
+    } else if (arg == "--numa") {
+      NUMA_AWARE = true;
+    } else if (arg == "--delimiter" && i + 1 < argc) {
+      std::string delimiter = argv[++i];
+      if (delimiter == "\\t" || delimiter == "tab") {
+        delimiter = "\t";
+      }
+      if (delimiter != ";" && delimiter != "," && delimiter != "|" && delimiter != "\t") {
+        std::cerr << "Unsupported delimiter: " << argv[i] << std::endl;
+        return false;
+      }
+      INPUT_DELIMITER = delimiter[0];
+    } else if (arg == "--percentiles") {
+      PERCENTILES = true;
+    } else if (arg == "--station" && i + 1 < argc) {
+      ROW_FILTER.addStation(argv[++i]);
+    } else if (arg == "--prefix" && i + 1 < argc) {
+      ROW_FILTER.addPrefix(argv[++i]);
+    } else if (arg == "--min-temp" && i + 1 < argc) {
+      minTemp = argv[++i];
+    } else if (arg == "--max-temp" && i + 1 < argc) {
+      maxTemp = argv[++i];
+    } else if (arg == "--decimals" && i + 1 < argc) {
+      INPUT_DECIMALS = std::atoi(argv[++i]);
+      if (INPUT_DECIMALS != 1 && INPUT_DECIMALS != 2) {
+        std::cerr << "Unsupported number of decimals: " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg == "--time-bucket" && i + 1 < argc) {
+      TIME_BUCKET_SECONDS = std::atoll(argv[++i]);
+      if (TIME_BUCKET_SECONDS < 1) {
+        std::cerr << "Invalid time bucket: " << argv[i] << std::endl;
+        return false;
+      }
+    } else if (arg == "--convert" && i + 1 < argc) {
+      CONVERT_OUTPUT = argv[++i];
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      CHECKPOINT_PATH = argv[++i];
+    } else if (arg == "--serve" && i + 1 < argc) {
+      SERVE_SOCKET = argv[++i];
+    } else if (arg == "--index" && i + 1 < argc) {
+      INDEX_PATH = argv[++i];
+    } else if (arg == "--range" && i + 1 < argc) {
+      std::string range = argv[++i];
+      size_t colon = range.find(':');
+      char* end;
+      if (colon == std::string::npos) {
+        std::cerr << "Invalid range, expected START:END: " << range << std::endl;
+        return false;
+      }
+      RANGE_START = colon == 0 ? 0 : std::strtoull(range.c_str(), &end, 10);
+      bool valid = colon == 0 || end == range.c_str() + colon;
+      if (colon + 1 < range.size()) {
+        RANGE_END = std::strtoull(range.c_str() + colon + 1, &end, 10);
+        valid = valid && *end == '\0';
+      }
+      if (!valid || RANGE_START > RANGE_END) {
+        std::cerr << "Invalid range, expected START:END: " << range << std::endl;
+        return false;
+      }
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    } else {
+      inputArgs.push_back(arg);
+    }
+  }
 
-  int ptr = startIndex;
-  bool isPos = true;
-  if (data[ptr] == '+') {
-    ++ptr;
-  } else if (data[ptr] == '-') {
-    ++ptr;
-    isPos = false;
+  if (PERCENTILES
+      && (INPUT_DECIMALS != 1 || !CHECKPOINT_PATH.empty() || !CONVERT_OUTPUT.empty())) {
+    std::cerr << "--percentiles needs one decimal and no --checkpoint or --convert" << std::endl;
+    return false;
   }
 
-  for (;data[ptr] != '\n'; ++ptr) {
-    if (data[ptr] == '.') {
-      continue;
+  // Bounds are scaled like the parsed values, so this waits for --decimals.
+  auto parseBound = [](const std::string& text, int fallback, int& result) {
+    if (text.empty()) {
+      result = fallback;
+      return true;
+    }
+    char* end;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end != '\0') {
+      std::cerr << "Invalid temperature: " << text << std::endl;
+      return false;
     }
+    result = (int) std::lround(value * std::pow(10, INPUT_DECIMALS));
+    return true;
+  };
+  int minValue, maxValue;
+  if (!parseBound(minTemp, INT_MIN, minValue) || !parseBound(maxTemp, INT_MAX, maxValue)) {
+    return false;
+  }
+  ROW_FILTER.setValueRange(minValue, maxValue);
+  if (ROW_FILTER.active() && !CHECKPOINT_PATH.empty()) {
+    std::cerr << "Filters cannot be combined with --checkpoint" << std::endl;
+    return false;
+  }
+  if (!SERVE_SOCKET.empty() && (!CONVERT_OUTPUT.empty() || !CHECKPOINT_PATH.empty())) {
+    std::cerr << "--serve cannot be combined with --convert or --checkpoint" << std::endl;
+    return false;
+  }
+  bool rangeQuery = !INDEX_PATH.empty() || RANGE_START != 0 || RANGE_END != SIZE_MAX;
+  if (rangeQuery && (PERCENTILES || ROW_FILTER.active() || !CONVERT_OUTPUT.empty()
+      || !CHECKPOINT_PATH.empty() || !SERVE_SOCKET.empty())) {
+    std::cerr << "--index and --range cannot be combined with --percentiles, filters,"
+      << " --convert, --checkpoint or --serve" << std::endl;
+    return false;
+  }
+  if (TIME_BUCKET_SECONDS > 0 && (PERCENTILES || ROW_FILTER.active()
+      || !CONVERT_OUTPUT.empty() || !CHECKPOINT_PATH.empty())) {
+    std::cerr << "--time-bucket cannot be combined with --percentiles, filters,"
+      << " --convert or --checkpoint" << std::endl;
+    return false;
+  }
+  return true;
+}
 
-    temp10 = temp10 * 10 + (data[ptr] - '0');
+/**
+ * Adds the non-hidden regular files of directory to files, sorted by name.
+*/
+bool listDirectory(const std::string& directory, std::vector<std::string>& files) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    std::cerr << "Error opening directory: " << directory << std::endl;
+    return false;
   }
 
-  result = isPos ? temp10 : -temp10;
+  std::vector<std::string> entries;
+  while (struct dirent* entry = readdir(dir)) {
+    std::string path = directory + "/" + entry->d_name;
+    struct stat sb;
+    if (entry->d_name[0] != '.' && stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+      entries.push_back(path);
+    }
+  }
+  closedir(dir);
 
-  return ptr;
+  std::sort(entries.begin(), entries.end());
+  files.insert(files.end(), entries.begin(), entries.end());
+  return true;
 }
 
 /**
- * Find the index of last \n in data, in the range of [startIdx, endIdx)
+ * Expands the input arguments into the list of files to read. Directories
+ * contribute their files and patterns that do not name an existing path are
+ * expanded with glob(3).
 */
-int findLastRowEnd(const char* data, int startIdx, int endIdx) {
-  int ptr = endIdx - 1;
-  for (;ptr >= startIdx;--ptr) {
-    if (data[ptr] == '\n') {
-      return ptr;
+bool expandInputs(const std::vector<std::string>& args, std::vector<std::string>& files) {
+  for (const std::string& arg: args) {
+    struct stat sb;
+    if (arg == "-" || stat(arg.c_str(), &sb) == 0) {
+      if (arg != "-" && S_ISDIR(sb.st_mode)) {
+        if (!listDirectory(arg, files)) {
+          return false;
+        }
+      } else {
+        files.push_back(arg);
+      }
+      continue;
+    }
+
+    glob_t matches;
+    if (arg.find_first_of("*?[") == std::string::npos
+        || glob(arg.c_str(), 0, nullptr, &matches) != 0) {
+      std::cerr << "No input matches: " << arg << std::endl;
+      return false;
+    }
+    std::vector<std::string> matched(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    globfree(&matches);
+    for (const std::string& path: matched) {
+      if (stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        if (!listDirectory(path, files)) {
+          return false;
+        }
+      } else {
+        files.push_back(path);
+      }
     }
   }
-  return ptr;
+  return true;
 }
 
 /**
- * Similar to findLastRowEnd, but if the last row is incomplete, find its
- * end without exceeding dataSize.
+ * Map the whole file read-only, applying the mapping options. Returns nullptr
+ * on failure.
 */
-int findLastRowEndExtended(const char* data, int startIdx, int endIdx, int dataSize) {
-  int lastRowEnd = findLastRowEnd(data, startIdx, endIdx);
-  if (lastRowEnd == endIdx - 1) {
-    return lastRowEnd;
+char* mapInputFile(int fd, size_t fileSize) {
+  int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  if (MAP_POPULATE_PAGES) {
+    flags |= MAP_POPULATE;
   }
-  int ptr = lastRowEnd + 1;
-  while (ptr < dataSize && data[ptr] != '\n') {
-    ++ptr;
+#endif
+
+  void* data = mmap(nullptr, fileSize, PROT_READ, flags, fd, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
   }
-  return ptr < dataSize ? ptr : lastRowEnd;
+
+  if (MADVISE_SEQUENTIAL) {
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+  }
+#ifdef MADV_HUGEPAGE
+  if (MADVISE_HUGEPAGE) {
+    madvise(data, fileSize, MADV_HUGEPAGE);
+  }
+#endif
+  return (char*) data;
 }
 
 /**
- * Find the index of first \n in data, in the range of [startIdx, endIdx)
+ * Hands out row-aligned chunks from several mapped files. Workers drain the
+ * current file's cursor and move on to the next file together, so small files
+ * are split across the pool just like one large file and nobody waits at a
+ * file boundary.
 */
-int findFirstRowEnd(const char* data, int startIdx, int endIdx) {
-  for (int ptr = startIdx; ptr < endIdx; ++ptr) {
-    if (data[ptr] == '\n') {
-      return ptr;
+class FileSetCursor {
+public:
+  struct MappedFile {
+    const char* data;
+    size_t size;
+  };
+
+  explicit FileSetCursor(const std::vector<MappedFile>& files): files(files) {
+    for (const MappedFile& file: files) {
+      cursors.push_back(std::make_unique<ChunkCursor>(file.data, 0, file.size));
     }
   }
-  return endIdx;
+
+  bool next(const char*& data, size_t& chunkStart, size_t& chunkEnd) {
+    size_t idx = current.load();
+    while (idx < files.size()) {
+      if (cursors[idx]->next(chunkStart, chunkEnd)) {
+        data = files[idx].data;
+        return true;
+      }
+      current.compare_exchange_weak(idx, idx + 1);
+      idx = current.load();
+    }
+    return false;
+  }
+
+private:
+  const std::vector<MappedFile>& files;
+  std::vector<std::unique_ptr<ChunkCursor>> cursors;
+  std::atomic<size_t> current{0};
+};
+
+/**
+ * Aggregates several text files on one pool. All files are mapped up front
+ * and their chunks scheduled through one FileSetCursor.
+*/
+bool handleMappedFiles(
+    const std::vector<std::string>& paths,
+    WorkerPool& pool,
+    std::vector<Stations>& threadStations
+) {
+  std::vector<FileSetCursor::MappedFile> files;
+  auto unmapAll = [&] {
+    for (const auto& file: files) {
+      munmap((void*) file.data, file.size);
+    }
+  };
+
+  for (const std::string& path: paths) {
+    int fd = path == "-" ? -1 : open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      std::cerr << "Error opening file: " << path << std::endl;
+      unmapAll();
+      return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || isEncodedFile(fd, sb.st_size)) {
+      std::cerr << "Not a regular text file: " << path << std::endl;
+      close(fd);
+      unmapAll();
+      return false;
+    }
+
+    if (sb.st_size > 0) {
+      char* data = mapInputFile(fd, sb.st_size);
+      if (data == nullptr) {
+        std::cerr << "Error mapping file: " << path << std::endl;
+        close(fd);
+        unmapAll();
+        return false;
+      }
+      files.push_back({data, (size_t) sb.st_size});
+    }
+    close(fd);
+  }
+
+  FileSetCursor chunks(files);
+  pool.run([&](int workerId) {
+    const char* data;
+    size_t chunkStart, chunkEnd;
+    while (chunks.next(data, chunkStart, chunkEnd)) {
+      handleChunk(data, chunkStart, chunkEnd, threadStations[workerId]);
+    }
+  });
+
+  unmapAll();
+  return true;
 }
 
 /**
- * Handle the chunk in data with range [startIdx, endIdx).
- * Skip the incomplete row at beginning (as it should be handled by the previous threads)
- * but handle the incomplete row at the end.
+ * Set by SIGINT and SIGTERM so a --serve daemon can remove its socket.
 */
-void handleChunk(
-    const char * data,
-    int startIdx,
-    int endIdx,
-    Stations& stations)
-{
-  int ptr = startIdx;
+volatile sig_atomic_t SERVER_STOPPING = 0;
 
-  while (ptr < endIdx) {
-    // get name
-    std::string name;
-    const char *nameStart = data + ptr;
-    for (;ptr < endIdx; ++ptr) {
-      if (data[ptr] == ';') {
-        name = std::string(nameStart, data + ptr);
-        break;
+/**
+ * The --serve daemon. The per-worker tables of everything parsed so far stay
+ * in memory as partial aggregates. Rows appended to the input are folded into
+ * them when inotify reports a write, after which they are merged and the
+ * response is rendered once, so answering a query is a single write of a
+ * cached string.
+ *
+ * Only complete rows are folded; a row still being written is picked up once
+ * its '\n' arrives. If the input shrinks, is rewritten before the folded
+ * offset or is replaced by another file, it is aggregated again from the
+ * start.
+ *
+ * Protocol: a client connects, sends one command line, "get" (or nothing) for
+ * the result or "stop" to shut the server down, and reads the reply until the
+ * server closes the connection.
+*/
+class AggregationServer {
+public:
+  AggregationServer(const std::string& inputPath, WorkerPool& pool)
+    : inputPath(inputPath), pool(pool) {}
+
+  ~AggregationServer() {
+    if (inputFd != -1) {
+      close(inputFd);
+    }
+    if (inotifyFd != -1) {
+      close(inotifyFd);
+    }
+    if (listenFd != -1) {
+      close(listenFd);
+      unlink(socketPath.c_str());
+    }
+  }
+
+  /**
+   * Aggregates the input and serves queries on socket path until stopped.
+   * Returns false if the server could not start.
+  */
+  bool run(const std::string& path) {
+    socketPath = path;
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == -1) {
+      std::cerr << "Error initializing inotify" << std::endl;
+      return false;
+    }
+    if (!reload() || !listenOn()) {
+      return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action = {};
+    action.sa_handler = [](int) { SERVER_STOPPING = 1; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    std::cerr << "Serving " << inputPath << " on " << socketPath << std::endl;
+
+    while (!SERVER_STOPPING) {
+      pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {listenFd, POLLIN, 0}};
+      // While the path names another file, or none, look for it every second.
+      int ready = poll(fds, 2, detached ? 1000 : -1);
+      if (ready < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Error polling: " << strerror(errno) << std::endl;
+        return false;
+      }
+      // Fold appends first, so a query that arrives with them sees them.
+      if (ready == 0 || (fds[0].revents & POLLIN)) {
+        handleEvents();
+      }
+      if (fds[1].revents & POLLIN) {
+        int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+          continue;
+        }
+        bool keepRunning = handleClient(client);
+        close(client);
+        if (!keepRunning) {
+          break;
+        }
       }
     }
+    return true;
+  }
 
-    ++ptr; // consume ";"
-    int temperature10 = -1000;
-    ptr = fastS2I(data, ptr, temperature10);
-    ++ptr; // consum "\n"
+private:
+  // A client that sends nothing must not stall the server.
+  static constexpr int CLIENT_TIMEOUT_MS = 1000;
+
+  /**
+   * Opens the input and aggregates it from the start. On failure the
+   * previous input and result are kept.
+  */
+  bool reload() {
+    int fd = open(inputPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      std::cerr << "Error opening file: " << inputPath << std::endl;
+      return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || isEncodedFile(fd, sb.st_size)) {
+      std::cerr << "Not a regular text file: " << inputPath << std::endl;
+      close(fd);
+      return false;
+    }
 
-    stations.try_emplace(name, Station());
-    stations[name].addMeasurement(temperature10);
+    // Watch before parsing, so no append in between is missed.
+    int newWatch = inotify_add_watch(inotifyFd, inputPath.c_str(),
+      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (newWatch == -1) {
+      std::cerr << "Error watching file: " << inputPath << std::endl;
+      close(fd);
+      return false;
+    }
+    if (watchFd != -1 && watchFd != newWatch) {
+      inotify_rm_watch(inotifyFd, watchFd);
+    }
+    watchFd = newWatch;
+    if (inputFd != -1) {
+      close(inputFd);
+    }
+    inputFd = fd;
+    inputStat = sb;
+    detached = false;
+
+    threadStations = std::vector<Stations>(pool.size());
+    pinWorkers(pool, threadStations);
+    rowsEnd = 0;
+    foldedTailHash = 0;
+    fold(true);
+    return true;
   }
-}
 
-void handleMappedMemoryWithThreads(
-    char *fileData,
-    size_t mapSize,
-    std::string& prevLeftOverData,
-    std::vector<Stations>& threadStations
-) {
-  int firstEndOfRow = -1;
-  if (prevLeftOverData.size() != 0) {
-    firstEndOfRow = findFirstRowEnd(fileData, 0, mapSize);
-    std::string row = prevLeftOverData + std::string(fileData, firstEndOfRow + 1);
-    handleChunk(row.c_str(), 0, row.length(), threadStations[0]);
-    prevLeftOverData = "";
+  /**
+   * Parses the complete rows appended since the last fold into the worker
+   * tables and re-renders the response if any were added, or if refresh.
+  */
+  void fold(bool refresh = false) {
+    struct stat sb;
+    if (fstat(inputFd, &sb)) {
+      return;
+    }
+    size_t fileSize = sb.st_size;
+    if (fileSize < rowsEnd) {
+      reload();
+      return;
+    }
+
+    if (fileSize > rowsEnd) {
+      char* data = mapInputFile(inputFd, fileSize);
+      if (data == nullptr) {
+        std::cerr << "Error mapping file: " << inputPath << std::endl;
+        return;
+      }
+      if (rowsEnd > 0 && tailHash(data) != foldedTailHash) {
+        munmap(data, fileSize);
+        reload();
+        return;
+      }
+      size_t lastRowEnd = findLastRowEnd(data, rowsEnd, fileSize);
+      if (lastRowEnd != fileSize) {
+        handleMappedFile(data, rowsEnd, lastRowEnd + 1, pool, threadStations);
+        rowsEnd = lastRowEnd + 1;
+        foldedTailHash = tailHash(data);
+        refresh = true;
+      }
+      munmap(data, fileSize);
+    }
+
+    if (refresh) {
+      MergedStations merged = mergeWorkerStations(pool, threadStations);
+      response = formatOutput(merged);
+    }
   }
 
-  int lastEndOfRow = findLastRowEnd(fileData, 0, mapSize);
-  if (lastEndOfRow != mapSize - 1) {
-    prevLeftOverData = std::string(fileData + lastEndOfRow + 1, mapSize - lastEndOfRow - 1);
+  /**
+   * Hash of the last folded bytes, to notice the input being rewritten
+   * rather than appended to.
+  */
+  uint32_t tailHash(const char* data) const {
+    size_t size = std::min(rowsEnd, CHECKPOINT_FINGERPRINT_SIZE);
+    return hashName(data + rowsEnd - size, size);
   }
 
-  std::vector<std::thread> threads;
+  /**
+   * Drains the pending inotify events, then folds appends or reloads if the
+   * path now names another file. Replacing the input by a rename only shows
+   * up as a link count change (IN_ATTRIB) while the old file is open here.
+  */
+  void handleEvents() {
+    alignas(inotify_event) char events[4096];
+    bool checkPath = detached;
+    ssize_t n;
+    while ((n = read(inotifyFd, events, sizeof(events))) > 0) {
+      for (char* event = events; event < events + n; ) {
+        const inotify_event* header = (const inotify_event*) event;
+        if (header->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) {
+          checkPath = true;
+        }
+        if (header->mask & IN_IGNORED) {
+          watchFd = -1;
+        }
+        event += sizeof(inotify_event) + header->len;
+      }
+    }
 
-  int threadBeginIdx = firstEndOfRow + 1;
-  for (int i = 0; i < THREADS_COUNT; ++i) {
-    int threadEndIdx = std::min(threadBeginIdx+ CHUNK_SIZE, mapSize);
-    int threadEndIdxExtended = findLastRowEndExtended(
-      fileData,
-      threadBeginIdx,
-      threadEndIdx,
-      mapSize
-    );
-
-    // std::cerr << "threadId: " << i << " " << threadBeginIdx << " " << threadEndIdx + 1
-    //   << std::endl;
-
-    threads.emplace_back(
-      handleChunk,
-      fileData,
-      threadBeginIdx,
-      threadEndIdxExtended + 1,
-      std::ref(threadStations[i])
-    );
-
-    // handleChunk(
-    //   fileData,
-    //   threadBeginIdx,
-    //   threadEndIdxExtended + 1,
-    //   threadStations[i]
-    // );
-
-    threadBeginIdx = threadEndIdxExtended + 1;
-    if (threadBeginIdx > lastEndOfRow) {
-      break;
+    if (checkPath) {
+      struct stat sb;
+      if (stat(inputPath.c_str(), &sb) != 0) {
+        detached = true;
+      } else if (sb.st_dev != inputStat.st_dev || sb.st_ino != inputStat.st_ino) {
+        detached = true;
+        if (reload()) {
+          return;
+        }
+      } else {
+        detached = false;
+      }
     }
+    fold();
   }
 
+  /**
+   * Answers one client. Returns false if it asked the server to stop.
+  */
+  bool handleClient(int client) {
+    timeval timeout = {CLIENT_TIMEOUT_MS / 1000, (CLIENT_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char command[64];
+    size_t length = 0;
+    while (length < sizeof(command) && memchr(command, '\n', length) == nullptr) {
+      ssize_t n = read(client, command + length, sizeof(command) - length);
+      if (n <= 0) {
+        break;
+      }
+      length += n;
+    }
+    std::string_view request(command, length);
+    request = request.substr(0, request.find_first_of("\r\n"));
 
-  for (auto& t: threads) {
-    t.join();
+    if (request.empty() || request == "get") {
+      writeAll(client, response.data(), response.size());
+    } else if (request == "stop") {
+      writeAll(client, "stopping\n", 9);
+      return false;
+    } else {
+      const char error[] = "unknown command\n";
+      writeAll(client, error, sizeof(error) - 1);
+    }
+    return true;
   }
-}
 
-Stations mergeThreadStations(std::vector<Stations>& threadStations) {
-  Stations result;
-  for (Stations& st: threadStations) {
-    for (auto kv: st) {
-      result.try_emplace(kv.first, Station());
-      result[kv.first].merge(kv.second);
+  bool listenOn() {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+      std::cerr << "Socket path too long: " << socketPath << std::endl;
+      return false;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    // Replace a socket left behind by a server that was killed.
+    struct stat sb;
+    if (lstat(socketPath.c_str(), &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+      unlink(socketPath.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (const sockaddr*) &address, sizeof(address)) != 0) {
+      std::cerr << "Error binding socket: " << socketPath << std::endl;
+      if (fd != -1) {
+        close(fd);
+      }
+      return false;
     }
+    listenFd = fd;
+    if (listen(listenFd, 64) != 0) {
+      std::cerr << "Error listening on socket: " << socketPath << std::endl;
+      return false;
+    }
+    return true;
   }
-  return result;
-}
+
+  std::string inputPath;
+  std::string socketPath;
+  WorkerPool& pool;
+  std::vector<Stations> threadStations;
+  std::string response;
+
+  int inputFd = -1;
+  struct stat inputStat = {};
+  size_t rowsEnd = 0;
+  uint32_t foldedTailHash = 0;
+
+  int inotifyFd = -1;
+  int watchFd = -1;
+  // The input was moved or deleted; the path may name another file by now.
+  bool detached = false;
+  int listenFd = -1;
+};
 
 int main(int argc, char** argv) {
-  if (argc > 1) {
-    inputFileName = argv[1];
+  if (!parseArgs(argc, argv)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+  handleChunk = selectChunkHandler();
+#ifndef ONEBRC_STATS
+  if (PRINT_STATS) {
+    std::cerr << "Statistics are not compiled in, build with make calc_stats" << std::endl;
+  }
+#endif
+
+  bool rangeQuery = !INDEX_PATH.empty() || RANGE_START != 0 || RANGE_END != SIZE_MAX;
+  std::vector<std::string> inputFiles;
+  if (inputArgs.empty()) {
+    inputFiles.push_back(inputFileName);
+  } else if (!expandInputs(inputArgs, inputFiles)) {
+    return 1;
+  }
+
+  if (inputFiles.size() != 1) {
+    if (inputFiles.empty()) {
+      std::cerr << "No input files" << std::endl;
+      return 1;
+    }
+    if (!CONVERT_OUTPUT.empty() || !CHECKPOINT_PATH.empty() || !SERVE_SOCKET.empty()
+        || rangeQuery) {
+      std::cerr << "--convert, --checkpoint, --serve, --index and --range take a single input file"
+        << std::endl;
+      return 1;
+    }
+
+    WorkerPool pool(THREADS_COUNT);
+    std::vector<Stations> threadStations(THREADS_COUNT);
+    pinWorkers(pool, threadStations);
+    STATS(uint64_t readStart = readTicks();)
+    if (!handleMappedFiles(inputFiles, pool, threadStations) || MALFORMED_INPUT) {
+      return 1;
+    }
+    STATS(RUN_STATS.parseTicks += readTicks() - readStart;)
+
+    STATS(uint64_t mergeStart = readTicks();)
+    MergedStations merged = mergeWorkerStations(pool, threadStations);
+    STATS(RUN_STATS.mergeTicks += readTicks() - mergeStart;)
+
+    STATS(uint64_t outputStart = readTicks();)
+    output(merged);
+    STATS(RUN_STATS.outputTicks += readTicks() - outputStart;)
+
+    STATS(if (PRINT_STATS) printStats();)
+    return 0;
+  }
+  inputFileName = inputFiles[0];
+
+  if (!SERVE_SOCKET.empty()) {
+    if (inputFileName == "-") {
+      std::cerr << "--serve needs a regular text file as input" << std::endl;
+      return 1;
+    }
+    WorkerPool pool(THREADS_COUNT);
+    AggregationServer server(inputFileName, pool);
+    bool ok = server.run(SERVE_SOCKET);
+    STATS(if (PRINT_STATS) printStats();)
+    return ok ? 0 : 1;
   }
 
-  int fd = open(inputFileName.c_str(), O_RDONLY);
+  int fd = inputFileName == "-" ? STDIN_FILENO : open(inputFileName.c_str(), O_RDONLY);
   if (fd == -1) {
     std::cerr << "Error opening file: " << inputFileName << std::endl;
     return 1;
@@ -282,29 +4118,136 @@ int main(int argc, char** argv) {
   }
 
   size_t fileSize = sb.st_size;
-  size_t ptr = 0;
+  bool seekable = S_ISREG(sb.st_mode);
+
+  WorkerPool pool(THREADS_COUNT);
+  std::vector<Stations> threadStations(THREADS_COUNT);
+  pinWorkers(pool, threadStations);
+  MergedStations merged;
+  bool encoded = seekable && isEncodedFile(fd, fileSize);
+  Checkpoint checkpoint;
+  // Chunk aggregates taken from the --index.
+  Stations indexedRows(16);
+
+  if (!CHECKPOINT_PATH.empty() && (!seekable || encoded)) {
+    std::cerr << "--checkpoint needs a regular text file as input" << std::endl;
+    close(fd);
+    return 1;
+  }
+  if (rangeQuery && (!seekable || encoded)) {
+    std::cerr << "--index and --range need a regular text file as input" << std::endl;
+    close(fd);
+    return 1;
+  }
+
+  if (!CONVERT_OUTPUT.empty()) {
+    if (!seekable || encoded) {
+      std::cerr << "--convert needs a regular text file as input" << std::endl;
+      close(fd);
+      return 1;
+    }
+    char* fileData = fileSize > 0 ? mapInputFile(fd, fileSize) : nullptr;
+    if (fileSize > 0 && fileData == nullptr) {
+      std::cerr << "Error mapping file!" << std::endl;
+      close(fd);
+      return 1;
+    }
+    bool ok = convertFile(fileData, fileSize, pool, CONVERT_OUTPUT);
+    if (fileData != nullptr) {
+      munmap(fileData, fileSize);
+    }
+    close(fd);
+    STATS(if (PRINT_STATS) printStats();)
+    return ok ? 0 : 1;
+  }
 
-  std::string leftOverData = "";
+  if (encoded && (PERCENTILES || ROW_FILTER.active() || TIME_BUCKET_SECONDS > 0)) {
+    std::cerr << "--percentiles, filters and --time-bucket are not supported for encoded input"
+      << std::endl;
+    close(fd);
+    return 1;
+  }
 
-  std::vector<Stations> threadStations(THREADS_COUNT, Stations());
+  if (encoded) {
+    STATS(uint64_t mapStart = readTicks();)
+    char* fileData = mapInputFile(fd, fileSize);
+    STATS(RUN_STATS.mapTicks += readTicks() - mapStart;)
+    if (fileData == nullptr) {
+      std::cerr << "Error mapping file!" << std::endl;
+      close(fd);
+      return 1;
+    }
 
-  while (ptr < fileSize) {
-    size_t mapSize = std::min(CHUNK_SIZE * THREADS_COUNT, fileSize - ptr);
-    char* fileData = (char*)mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, ptr);
-    if (fileData == MAP_FAILED) {
+    STATS(uint64_t readStart = readTicks();)
+    bool ok = handleEncodedFile(fileData, fileSize, pool, merged);
+    STATS(RUN_STATS.parseTicks += readTicks() - readStart;)
+    munmap(fileData, fileSize);
+    if (!ok) {
+      close(fd);
+      return 1;
+    }
+  } else if ((READER != "mmap" && CHECKPOINT_PATH.empty() && !rangeQuery) || !seekable) {
+    STATS(uint64_t readStart = readTicks();)
+    if (!handleStreamedFile(fd, seekable, fileSize, pool, threadStations)) {
+      close(fd);
+      return 1;
+    }
+    STATS(RUN_STATS.parseTicks += readTicks() - readStart;)
+  } else if (fileSize > 0) {
+    STATS(uint64_t mapStart = readTicks();)
+    char* fileData = mapInputFile(fd, fileSize);
+    STATS(RUN_STATS.mapTicks += readTicks() - mapStart;)
+    if (fileData == nullptr) {
       std::cerr << "Error mapping file!" << std::endl;
       close(fd);
       return 1;
     }
 
-    handleMappedMemoryWithThreads(fileData, mapSize, leftOverData, threadStations);
+    STATS(uint64_t readStart = readTicks();)
+    if (rangeQuery) {
+      if (!handleRangeQuery(fileData, fileSize, sb, pool, threadStations, indexedRows)) {
+        munmap(fileData, fileSize);
+        close(fd);
+        return 1;
+      }
+    } else if (CHECKPOINT_PATH.empty()) {
+      handleMappedFile(fileData, 0, fileSize, pool, threadStations);
+    } else {
+      loadCheckpoint(CHECKPOINT_PATH, sb, fileData, fileSize, checkpoint);
+      // A row after the last \n may still be half written; it is left for
+      // the run that sees its \n, like --serve does.
+      size_t lastRowEnd = findLastRowEnd(fileData, checkpoint.offset, fileSize);
+      size_t rowsEnd = lastRowEnd == fileSize ? checkpoint.offset : lastRowEnd + 1;
+      handleMappedFile(fileData, checkpoint.offset, rowsEnd, pool, threadStations);
+      checkpoint.fingerprint(fileData, rowsEnd);
+    }
+    STATS(RUN_STATS.parseTicks += readTicks() - readStart;)
+    munmap(fileData, fileSize);
+  }
+  close(fd);
+  if (MALFORMED_INPUT) {
+    return 1;
+  }
+
+  if (!encoded) {
+    STATS(uint64_t mergeStart = readTicks();)
+    merged = mergeWorkerStations(pool, threadStations);
+    STATS(RUN_STATS.mergeTicks += readTicks() - mergeStart;)
+  }
 
-    ptr += mapSize;
-    munmap(fileData, mapSize);
+  if (!CHECKPOINT_PATH.empty()) {
+    mergeIntoShards(checkpoint.stations, merged);
+    if (!saveCheckpoint(CHECKPOINT_PATH, sb, checkpoint, merged)) {
+      return 1;
+    }
   }
+  mergeIntoShards(indexedRows, merged);
 
-  Stations merged = mergeThreadStations(threadStations);
+  STATS(uint64_t outputStart = readTicks();)
   output(merged);
+  STATS(RUN_STATS.outputTicks += readTicks() - outputStart;)
+
+  STATS(if (PRINT_STATS) printStats();)
 
   return 0;
 }
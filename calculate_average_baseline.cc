@@ -6,6 +6,7 @@
 #include <vector>
 #include <chrono>
 #include <functional>
+#include <iomanip>
 #include <cmath>
 
 bool DEBUGGING = true;
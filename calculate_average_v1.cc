@@ -6,6 +6,8 @@
 #include <vector>
 #include <chrono>
 #include <functional>
+#include <iomanip>
+#include <cmath>
 
 bool DEBUGGING = true;
 
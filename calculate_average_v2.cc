@@ -6,6 +6,8 @@
 #include <vector>
 #include <chrono>
 #include <functional>
+#include <iomanip>
+#include <cmath>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/stat.h>
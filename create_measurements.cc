@@ -20,29 +20,80 @@
 #include <string>
 #include <random>
 #include <chrono>
-#include <iomanip>
-#include <ctime>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * xoshiro256** seeded through splitmix64. Much cheaper than the standard
+ * engines, and every thread owns one, so there is no shared state.
+ */
+class FastRandom {
+public:
+    using result_type = uint64_t;
+
+    explicit FastRandom(uint64_t seed) {
+        for (auto& word : state) {
+            seed += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, bound), using the high bits of a 64x64 multiply.
+    uint64_t below(uint64_t bound) {
+        return (uint64_t) (((unsigned __int128) (*this)() * bound) >> 64);
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t state[4];
+};
 
 class WeatherStation {
 public:
     WeatherStation(const std::string& id, double meanTemperature)
         : id(id),
-        meanTemperature(meanTemperature),
-        dist(meanTemperature, 10.0) {}
+        meanTemperature(meanTemperature) {}
 
-    std::string getId() const {
+    const std::string& getId() const {
         return id;
     }
 
-    double measurement(std::default_random_engine& gen) {
-        double m = dist(gen);
-        return std::round(m * 10.0) / 10.0;
+    double getMeanTemperature() const {
+        return meanTemperature;
     }
 
 private:
     std::string id;
     double meanTemperature;
-    std::normal_distribution<double> dist;
 };
 
 std::vector<WeatherStation> readStationsFromFile(const std::string& filename) {
@@ -60,48 +111,300 @@ std::vector<WeatherStation> readStationsFromFile(const std::string& filename) {
     return stations;
 }
 
-int main(int argc, char* argv[]) {
-    std::srand(std::time(0));
-    if (argc != 2) {
-        std::cerr << "Usage: create_measurements <number of records to create>" << std::endl;
-        return 1;
+/**
+ * Appends a temperature given in tenths, e.g. -123 as "-12.3".
+ */
+inline char* formatTenths(char* out, int tenths) {
+    if (tenths < 0) {
+        *out++ = '-';
+        tenths = -tenths;
+    }
+    int whole = tenths / 10;
+    if (whole >= 10) {
+        *out++ = '0' + whole / 10;
+    }
+    *out++ = '0' + whole % 10;
+    *out++ = '.';
+    *out++ = '0' + tenths % 10;
+    return out;
+}
+
+/**
+ * Appends one random UTF-8 character of at most maxBytes bytes. The mix of
+ * ASCII, Latin, CJK and emoji characters gives names of 1 to 4 byte
+ * characters, none of which contain ';' or '\n'.
+ */
+void appendRandomCharacter(std::string& name, size_t maxBytes, FastRandom& random) {
+    uint64_t kind = random.below(10);
+    uint32_t codePoint;
+    if (kind < 6 || maxBytes < 2) {
+        const char* letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        name.push_back(letters[random.below(52)]);
+        return;
+    }
+    if (kind < 8 || maxBytes < 3) {
+        codePoint = 0x00C0 + random.below(0x0250 - 0x00C0);
+        name.push_back((char) (0xC0 | (codePoint >> 6)));
+    } else if (kind < 9 || maxBytes < 4) {
+        codePoint = 0x4E00 + random.below(0xA000 - 0x4E00);
+        name.push_back((char) (0xE0 | (codePoint >> 12)));
+        name.push_back((char) (0x80 | ((codePoint >> 6) & 0x3F)));
+    } else {
+        codePoint = 0x1F300 + random.below(0x1F600 - 0x1F300);
+        name.push_back((char) (0xF0 | (codePoint >> 18)));
+        name.push_back((char) (0x80 | ((codePoint >> 12) & 0x3F)));
+        name.push_back((char) (0x80 | ((codePoint >> 6) & 0x3F)));
+    }
+    name.push_back((char) (0x80 | (codePoint & 0x3F)));
+}
+
+/**
+ * Builds keyCount unique station names of 1 to 100 bytes with mean
+ * temperatures between -10 and 30 degrees.
+ */
+std::vector<WeatherStation> createSyntheticStations(uint64_t keyCount, uint64_t seed) {
+    FastRandom random(seed ^ 0x5EED5EED5EED5EEDULL);
+    std::vector<WeatherStation> stations;
+    std::unordered_set<std::string> seen;
+    stations.reserve(keyCount);
+    while (stations.size() < keyCount) {
+        size_t length = 1 + random.below(100);
+        std::string name;
+        while (name.size() < length) {
+            appendRandomCharacter(name, length - name.size(), random);
+        }
+        if (!seen.insert(name).second) {
+            continue;
+        }
+        double mean = -10.0 + (double) random.below(401) / 10.0;
+        stations.emplace_back(name, mean);
+    }
+    return stations;
+}
+
+/**
+ * Picks stations either uniformly or with Zipfian skew, where the station
+ * of rank k is chosen with probability proportional to 1 / k^exponent.
+ */
+class StationSampler {
+public:
+    StationSampler(size_t stationCount, double zipfExponent) : stationCount(stationCount) {
+        if (zipfExponent <= 0) {
+            return;
+        }
+        cumulative.resize(stationCount);
+        double total = 0;
+        for (size_t i = 0; i < stationCount; ++i) {
+            total += 1.0 / std::pow((double) (i + 1), zipfExponent);
+            cumulative[i] = total;
+        }
+        for (auto& value : cumulative) {
+            value /= total;
+        }
+    }
+
+    size_t next(FastRandom& random) const {
+        if (cumulative.empty()) {
+            return random.below(stationCount);
+        }
+        double u = (double) (random() >> 11) * 0x1.0p-53;
+        size_t index = std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+        return std::min(index, stationCount - 1);
     }
 
-    int size;
+private:
+    size_t stationCount;
+    std::vector<double> cumulative;
+};
+
+/**
+ * Output shared by the generator threads. Rows are produced in fixed size
+ * blocks, each seeded from the base seed and its block number, so the file
+ * content only depends on the seed and not on the thread count. A thread
+ * reserves the file region for its block once the previous block has been
+ * placed, then writes it with pwrite without waiting on anyone.
+ */
+class MeasurementsFile {
+public:
+    MeasurementsFile(int fd, uint64_t expectedSize) : fd(fd) {
+        // Reserve the space up front so the writes do not extend the file.
+        if (posix_fallocate(fd, 0, expectedSize) != 0) {
+            std::cerr << "Could not preallocate " << expectedSize << " bytes, continuing" << std::endl;
+        }
+    }
+
+    bool write(uint64_t block, const char* data, size_t size) {
+        uint64_t placed = placedBlocks.load();
+        while (placed != block) {
+            placedBlocks.wait(placed);
+            placed = placedBlocks.load();
+        }
+        uint64_t offset = nextOffset.fetch_add(size);
+        placedBlocks.fetch_add(1);
+        placedBlocks.notify_all();
+
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, offset);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // Cuts the preallocated tail off once everything has been written.
+    bool finish() {
+        return ftruncate(fd, nextOffset.load()) == 0;
+    }
+
+private:
+    int fd;
+    std::atomic<uint64_t> nextOffset{0};
+    std::atomic<uint64_t> placedBlocks{0};
+};
+
+constexpr uint64_t ROWS_PER_BLOCK = 64 * 1024;
+// Longest row: 100 byte name, ';', "-99.9", '\n'.
+constexpr size_t MAX_ROW_LENGTH = 107;
+
+bool generateRows(
+    const std::vector<WeatherStation>& stations,
+    const StationSampler& sampler,
+    uint64_t rowCount,
+    uint64_t seed,
+    std::atomic<uint64_t>& nextBlock,
+    MeasurementsFile& file
+) {
+    std::unique_ptr<char[]> buffer(new char[ROWS_PER_BLOCK * MAX_ROW_LENGTH]);
+    uint64_t blockCount = (rowCount + ROWS_PER_BLOCK - 1) / ROWS_PER_BLOCK;
+
+    for (uint64_t block = nextBlock++; block < blockCount; block = nextBlock++) {
+        FastRandom random(seed + block * 0x9E3779B97F4A7C15ULL);
+        std::normal_distribution<double> deviation(0.0, 10.0);
+        uint64_t rows = std::min(ROWS_PER_BLOCK, rowCount - block * ROWS_PER_BLOCK);
+        char* out = buffer.get();
+
+        for (uint64_t i = 0; i < rows; ++i) {
+            const WeatherStation& station = stations[sampler.next(random)];
+            double temperature = station.getMeanTemperature() + deviation(random);
+            int tenths = (int) std::lround(temperature * 10.0);
+            tenths = std::max(-999, std::min(999, tenths));
+
+            const std::string& id = station.getId();
+            memcpy(out, id.data(), id.size());
+            out += id.size();
+            *out++ = ';';
+            out = formatTenths(out, tenths);
+            *out++ = '\n';
+        }
+        if (!file.write(block, buffer.get(), out - buffer.get())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage() {
+    std::cerr << "Usage: create_measurements [options] <number of records to create>" << std::endl;
+    std::cerr << "  --output PATH    file to write (default measurements.txt)" << std::endl;
+    std::cerr << "  --seed N         seed for a reproducible file (default random)" << std::endl;
+    std::cerr << "  --keys N         use N synthetic UTF-8 station names instead of station_temperature.conf" << std::endl;
+    std::cerr << "  --zipf S         pick stations with Zipfian skew of exponent S (default uniform)" << std::endl;
+    std::cerr << "  --threads N      number of generator threads (default all cores)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string outputPath = "measurements.txt";
+    uint64_t seed = std::random_device()();
+    uint64_t keyCount = 0;
+    double zipfExponent = 0;
+    int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t size = 0;
+    bool haveSize = false;
+
     try {
-        size = std::stoi(argv[1]);
-    } catch (const std::invalid_argument&) {
-        std::cerr << "Invalid value for <number of records to create>" << std::endl;
-        std::cerr << "Usage: create_measurements <number of records to create>" << std::endl;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--output" && hasValue) {
+                outputPath = argv[++i];
+            } else if (arg == "--seed" && hasValue) {
+                seed = std::stoull(argv[++i]);
+            } else if (arg == "--keys" && hasValue) {
+                keyCount = std::stoull(argv[++i]);
+            } else if (arg == "--zipf" && hasValue) {
+                zipfExponent = std::stod(argv[++i]);
+            } else if (arg == "--threads" && hasValue) {
+                threadCount = std::stoi(argv[++i]);
+            } else if (!haveSize && !arg.empty() && arg[0] != '-') {
+                size = std::stoull(arg);
+                haveSize = true;
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+    } catch (const std::logic_error&) {
+        std::cerr << "Invalid numeric argument" << std::endl;
+        printUsage();
         return 1;
     }
-
-    std::vector<WeatherStation> stations = readStationsFromFile("station_temperature.conf");
-    if (stations.empty()) {
-        std::cerr << "No stations found in station_temperature.conf" << std::endl;
+    if (!haveSize || threadCount < 1 || zipfExponent < 0) {
+        printUsage();
         return 1;
     }
 
-    std::ofstream outfile("measurements.txt");
-    if (!outfile) {
-        std::cerr << "Could not open measurements.txt for writing" << std::endl;
+    std::vector<WeatherStation> stations;
+    if (keyCount > 0) {
+        stations = createSyntheticStations(keyCount, seed);
+    } else {
+        stations = readStationsFromFile("station_temperature.conf");
+        if (stations.empty()) {
+            std::cerr << "No stations found in station_temperature.conf" << std::endl;
+            return 1;
+        }
+    }
+    StationSampler sampler(stations.size(), zipfExponent);
+
+    int fd = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::cerr << "Could not open " << outputPath << " for writing" << std::endl;
         return 1;
     }
 
     auto start = std::chrono::high_resolution_clock::now();
-    std::default_random_engine generator;
 
-    for (int i = 0; i < size; ++i) {
-        if (i > 0 && i % 50000000 == 0) {
-            auto now = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<double, std::milli> elapsed = now - start;
-            std::cout << "Wrote " << i << " measurements in " << elapsed.count() << " ms" << std::endl;
-        }
-        WeatherStation& station = stations[rand() % stations.size()];
-        outfile
-          << std::fixed << std::setprecision(1)
-          << station.getId() << ";" << station.measurement(generator) << "\n";
+    double averageIdLength = 0;
+    for (const auto& station : stations) {
+        averageIdLength += station.getId().size();
+    }
+    averageIdLength /= stations.size();
+    // ';', up to 5 temperature characters and '\n' per row.
+    MeasurementsFile file(fd, (uint64_t) (size * (averageIdLength + 7)));
+
+    std::atomic<uint64_t> nextBlock{0};
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&] {
+            if (!generateRows(stations, sampler, size, seed, nextBlock, file)) {
+                ok = false;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (!ok || !file.finish()) {
+        std::cerr << "Error writing " << outputPath << std::endl;
+        close(fd);
+        return 1;
     }
+    close(fd);
 
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> totalElapsed = end - start;
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Runs calc on every samples/*.txt and compares its output with the matching
+# .out file. Flags for a sample, if any, are read from the matching .args
+# file. Usage: ./test_samples.sh [binary]
+#
+
+BINARY=${1:-./calc}
+FAILED=0
+for input in samples/*.txt; do
+  base=${input%.txt}
+  args=""
+  if [ -f "$base.args" ]; then
+    args=$(cat "$base.args")
+  fi
+  # shellcheck disable=SC2086
+  if ! "$BINARY" $args "$input" 2>/dev/null | cmp -s - "$base.out"; then
+    echo "FAIL $input $args"
+    FAILED=1
+  fi
+done
+if [ $FAILED -eq 0 ]; then
+  echo "All samples passed"
+fi
+exit $FAILED